@@ -0,0 +1,169 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "cache.h"
+
+#define CACHE_MIN_SLOTS     64
+
+static inline uint32_t pc_hash(const struct page_cache *c, uint64_t key)
+{
+    /* Fibonacci hashing spreads sequential addresses over the table */
+    return (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & c->mask;
+}
+
+static inline uint64_t pc_page_key(const struct cache_page *p)
+{
+    return page_key(p->slaveid, p->function, p->addr, p->nb);
+}
+
+static int pc_resize(struct page_cache *c, uint32_t nslots)
+{
+    struct cache_page **old = c->slots;
+    uint32_t oldn = old ? c->mask + 1 : 0;
+    uint32_t i;
+
+    c->slots = calloc(nslots, sizeof(struct cache_page *));
+    if (!c->slots) {
+        c->slots = old;
+        return -1;
+    }
+    c->mask = nslots - 1;
+
+    for (i = 0; i < oldn; ++i) {
+        struct cache_page *p = old[i];
+        uint32_t h;
+
+        if (!p)
+            continue;
+        for (h = pc_hash(c, pc_page_key(p)); c->slots[h]; h = (h + 1) & c->mask)
+            ;
+        c->slots[h] = p;
+    }
+    free(old);
+
+    return 0;
+}
+
+static struct cache_page *pc_alloc(struct page_cache *c)
+{
+    struct cache_page *p;
+    int i;
+
+    if (!c->free) {
+        struct cache_page *slab = malloc(sizeof(struct cache_page) * CACHE_SLAB_PAGES);
+
+        if (!slab)
+            return NULL;
+        VADD(c->slabs, slab);
+        for (i = CACHE_SLAB_PAGES - 1; i >= 0; --i) {
+            slab[i].next = c->free;
+            c->free = &slab[i];
+        }
+    }
+
+    p = c->free;
+    c->free = p->next;
+    memset(p, 0, sizeof(*p));
+
+    return p;
+}
+
+/* New buffer holding the copy of `data', referenced once */
+struct mbuf *mbuf_new(const uint8_t *data, int len)
+{
+    struct mbuf *m = pool_alloc(sizeof(struct mbuf) + len);
+
+    if (!m)
+        return NULL;
+    m->ref = 1;
+    m->len = len;
+    memcpy(m->data, data, len);
+
+    return m;
+}
+
+void page_cache_init(struct page_cache *c)
+{
+    memset(c, 0, sizeof(*c));
+    VINIT(c->slabs);
+}
+
+struct cache_page *page_cache_lookup(struct page_cache *c, int slave, int func, int addr, int nb)
+{
+    uint64_t key = page_key(slave, func, addr, nb);
+    uint32_t h;
+
+    if (!c->count)
+        return NULL;
+
+    for (h = pc_hash(c, key); c->slots[h]; h = (h + 1) & c->mask) {
+        if (pc_page_key(c->slots[h]) == key)
+            return c->slots[h];
+    }
+
+    return NULL;
+}
+
+/* Returns the page of the tuple, a new zeroed one if it is not cached yet */
+struct cache_page *page_cache_insert(struct page_cache *c, int slave, int func, int addr, int nb)
+{
+    struct cache_page *p;
+    uint32_t h;
+
+    if ((p = page_cache_lookup(c, slave, func, addr, nb)))
+        return p;
+
+    /* Keep load factor below 1/2 for short probe sequences */
+    if (!c->slots || (c->count + 1) * 2 > c->mask + 1) {
+        if (pc_resize(c, c->slots ? (c->mask + 1) * 2 : CACHE_MIN_SLOTS) < 0)
+            return NULL;
+    }
+
+    if (!(p = pc_alloc(c)))
+        return NULL;
+
+    p->slaveid = slave;
+    p->function = func;
+    p->addr = addr;
+    p->nb = nb;
+
+    for (h = pc_hash(c, pc_page_key(p)); c->slots[h]; h = (h + 1) & c->mask)
+        ;
+    c->slots[h] = p;
+    c->count++;
+
+    return p;
+}
+
+void page_cache_remove(struct page_cache *c, struct cache_page *p)
+{
+    uint32_t h, i, j;
+
+    if (!c->count)
+        return;
+
+    for (h = pc_hash(c, pc_page_key(p)); c->slots[h] != p; h = (h + 1) & c->mask) {
+        if (!c->slots[h])
+            return;
+    }
+
+    /* Backward shift deletion: move followers of the probe chain into the hole */
+    i = h;
+    for (j = (i + 1) & c->mask; c->slots[j]; j = (j + 1) & c->mask) {
+        uint32_t k = pc_hash(c, pc_page_key(c->slots[j]));
+
+        /* Leave the page if its home slot is cyclically within (i, j] */
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+        c->slots[i] = c->slots[j];
+        i = j;
+    }
+    c->slots[i] = NULL;
+    c->count--;
+
+    mbuf_put(p->pdu);
+    p->pdu = NULL;
+    p->next = c->free;
+    c->free = p;
+}
@@ -0,0 +1,77 @@
+#ifndef _MBUS_CACHE__H
+#define _MBUS_CACHE__H 1
+
+#include <stdint.h>
+
+#include "vect.h"
+#include "timer.h"
+#include "pool.h"
+
+/* Largest MODBUS answer kept by the page: MBAP header + PDU */
+#define CACHE_PAGE_DATA     260
+
+#ifdef _NUTTX_BUILD
+#define CACHE_SLAB_PAGES    8
+#else
+#define CACHE_SLAB_PAGES    64
+#endif
+
+/*
+ * Answer PDU (function code first) shared by the cache page and
+ * the answers pending to the clients, freed by the last reference.
+ */
+struct mbuf {
+    int ref;
+    int len;
+    uint8_t data[];
+};
+
+struct cache_page {
+    uint8_t status;        /* 0 - ok, 1 - timeout, 2 - NA */
+    uint8_t slaveid;
+    uint16_t addr;
+    uint16_t function;
+    uint16_t nb;            /* quantity of registers/coils requested */
+    uint64_t ttd;           /* time to die of the page: last_timestamp + TTL, msec */
+    struct timer timer;     /* page expiration */
+    struct cache_page *next; /* free list link */
+    struct mbuf *pdu;       /* cached answer */
+};
+
+/*
+ * Pages are indexed by open addressing hash with linear probing
+ * on the full request tuple and allocated from fixed size slabs.
+ */
+struct page_cache {
+    struct cache_page **slots;
+    uint32_t mask;          /* number of slots - 1 */
+    uint32_t count;         /* number of pages in use */
+    struct cache_page *free;
+    VECT(struct cache_page *) slabs;
+};
+
+static inline struct mbuf *mbuf_get(struct mbuf *m)
+{
+    __atomic_add_fetch(&m->ref, 1, __ATOMIC_RELAXED);
+    return m;
+}
+
+static inline void mbuf_put(struct mbuf *m)
+{
+    if (m && __atomic_sub_fetch(&m->ref, 1, __ATOMIC_ACQ_REL) == 0)
+        pool_free(m);
+}
+
+static inline uint64_t page_key(int slave, int func, int addr, int nb)
+{
+    return ((uint64_t)(slave & 0xff) << 48) | ((uint64_t)(func & 0xffff) << 32) |
+           ((uint64_t)(addr & 0xffff) << 16) | (nb & 0xffff);
+}
+
+extern struct mbuf *mbuf_new(const uint8_t *data, int len);
+extern void page_cache_init(struct page_cache *c);
+extern struct cache_page *page_cache_lookup(struct page_cache *c, int slave, int func, int addr, int nb);
+extern struct cache_page *page_cache_insert(struct page_cache *c, int slave, int func, int addr, int nb);
+extern void page_cache_remove(struct page_cache *c, struct cache_page *p);
+
+#endif /* _MBUS_CACHE__H */
@@ -13,11 +13,18 @@
             v = val;                                        \
     }
 
-static int get_speed(const char *baud, int defval)
+/* Speed of the baud rate, -1 if the rate isn't supported */
+static int get_speed(const char *baud)
 {
     int spd;
 
-    if (!strcmp(baud, "9600"))
+    if (!strcmp(baud, "1200"))
+        spd = B1200;
+    else if (!strcmp(baud, "2400"))
+        spd = B2400;
+    else if (!strcmp(baud, "4800"))
+        spd = B4800;
+    else if (!strcmp(baud, "9600"))
         spd = B9600;
     else if (!strcmp(baud, "19200"))
         spd = B19200;
@@ -28,11 +35,59 @@ static int get_speed(const char *baud, int defval)
     else if (!strcmp(baud, "115200"))
         spd = B115200;
     else
-        spd = defval;
+        spd = -1;
 
     return spd;
 }
 
+/*
+ * Line settings "<baud>[@<data bits><parity n/e/o><stop bits>]",
+ * e.g. "19200@8e1". Returns c_cflag bits, -1 if the format is invalid.
+ */
+static int get_line(const char *line)
+{
+    const char *fmt = strchr(line, '@');
+    char baud[16];
+    size_t len = fmt ? (size_t)(fmt - line) : strlen(line);
+    int cflag;
+
+    if (len >= sizeof(baud))
+        return -1;
+    memcpy(baud, line, len);
+    baud[len] = '\0';
+
+    if ((cflag = get_speed(baud)) < 0)
+        return -1;
+    if (!fmt)
+        return CS8 | cflag;
+
+    if (strlen(++fmt) != 3)
+        return -1;
+
+    switch (fmt[0]) {
+    case '5': cflag |= CS5; break;
+    case '6': cflag |= CS6; break;
+    case '7': cflag |= CS7; break;
+    case '8': cflag |= CS8; break;
+    default: return -1;
+    }
+
+    switch (fmt[1]) {
+    case 'n': case 'N': break;
+    case 'e': case 'E': cflag |= PARENB; break;
+    case 'o': case 'O': cflag |= PARENB | PARODD; break;
+    default: return -1;
+    }
+
+    switch (fmt[2]) {
+    case '1': break;
+    case '2': cflag |= CSTOPB; break;
+    default: return -1;
+    }
+
+    return cflag;
+}
+
 #ifndef _NUTTX_BUILD
 static void cfg_expect_event(struct cfg *cfg, const enum yaml_event_type_e type)
 {
@@ -69,6 +124,39 @@ static int cfg_get_int(struct cfg *cfg, int def)
     return v;
 }
 
+/* Time value: plain number or with `s' suffix in seconds, with `ms' suffix in msec */
+static long cfg_get_msec(struct cfg *cfg, long def)
+{
+    long v;
+    char *end;
+    yaml_event_t event;
+
+    if (cfg->err)
+        return def;
+
+    yaml_parser_parse(&cfg->parser, &event);
+    if (event.type != YAML_SCALAR_EVENT) {
+        cfg->err = PARSER_SYNTAX;
+        v = def;
+    } else {
+        v = strtol((char *)event.data.scalar.value, &end, 10);
+        while (*end == ' ')
+            end++;
+        if (!strcmp(end, "ms")) {
+            /* already in msec */
+        } else if (!*end || !strcmp(end, "s")) {
+            v *= 1000;
+        } else {
+            cfg->err = INVALID_PARAM;
+            fprintf(stderr, "Invalid time value: %s\n", event.data.scalar.value);
+            v = def;
+        }
+    }
+    yaml_event_delete(&event);
+
+    return v;
+}
+
 static char *cfg_get_string(struct cfg *cfg, char *def, yaml_event_t *event)
 {
     char *v;
@@ -182,9 +270,11 @@ static void cfg_parse_rtu(struct cfg *cfg)
         return;
 
     memset(&r, 0, sizeof(struct rtu_desc));
+    r.thread = -1;
 
     VINIT(r.slave_id);
     VINIT(r.q);
+    page_cache_init(&r.cache);
 
     for (;;) {
         if (cfg->err)
@@ -260,21 +350,53 @@ static void cfg_parse_rtu(struct cfg *cfg)
                     fprintf(stderr, "Invalid param PORT for the RTU\n");
                 }
             } else if (!strcmp(v, "timeout")) {
+                r.timeout = cfg_get_msec(cfg, RTU_TIMEOUT);
+            } else if (!strcmp(v, "merge_gap")) {
+                r.merge_gap = cfg_get_int(cfg, 0);
+            } else if (!strcmp(v, "thread")) {
+                r.thread = cfg_get_int(cfg, -1);
+                if (r.thread < 0 || r.thread >= MAX_RTU_THREADS) {
+                    cfg->err = INVALID_PARAM;
+                    fprintf(stderr, "Invalid param THREAD for the RTU\n");
+                }
+            } else if (!strcmp(v, "frame_gap")) {
                 iv = cfg_get_int(cfg, -1);
-                r.timeout = iv;
+                if (r.type == RTU && iv > 0) {
+                    r.frame_gap = iv;
+                } else {
+                    cfg->err = INVALID_PARAM;
+                    fprintf(stderr, "Invalid param FRAME_GAP for the RTU (usec)\n");
+                }
+            } else if (!strcmp(v, "char_timeout")) {
+                iv = cfg_get_int(cfg, -1);
+                if (r.type == RTU && iv > 0) {
+                    r.char_timeout = iv;
+                } else {
+                    cfg->err = INVALID_PARAM;
+                    fprintf(stderr, "Invalid param CHAR_TIMEOUT for the RTU (usec)\n");
+                }
+            } else if (!strcmp(v, "window")) {
+                iv = cfg_get_int(cfg, 1);
+                if (r.type == TCP && iv >= 1 && iv <= MAX_WINDOW) {
+                    r.window = iv;
+                } else {
+                    cfg->err = INVALID_PARAM;
+                    fprintf(stderr, "Invalid param WINDOW for the RTU (1..%d)\n", MAX_WINDOW);
+                }
             } else if (!strcmp(v, "baud")) {
-                int spd;
+                int cflag;
 
                 if (!(v = cfg_get_string(cfg, NULL, &event)))
                     break;
 
-                spd = get_speed(v, B9600);
-
-                if (r.type == RTU) {
-                    r.cfg.serial.t.c_cflag = CS8 | spd;
+                if ((cflag = get_line(v)) < 0) {
+                    cfg->err = INVALID_PARAM;
+                    fprintf(stderr, "Invalid param BAUD for the RTU: %s\n", v);
+                } else if (r.type == RTU) {
+                    r.cfg.serial.t.c_cflag = cflag;
 #ifndef _NUTTX_BUILD
                 } else if (r.type == REALCOM) {
-                    r.cfg.realcom.t.c_cflag = CS8 | spd;
+                    r.cfg.realcom.t.c_cflag = cflag;
 #endif
                 } else {
                     cfg->err = INVALID_PARAM;
@@ -297,9 +419,13 @@ static void cfg_parse_rtu(struct cfg *cfg)
             if (r.timeout == 0) {
                 r.timeout = RTU_TIMEOUT;
             }
+            if (r.window == 0) {
+                r.window = 1;
+            }
             VADD(cfg->rtu_list, r);
 
             memset(&r, 0, sizeof(struct rtu_desc));
+            r.thread = -1;
 
 out:
             yaml_event_delete(&event);
@@ -363,9 +489,15 @@ static void cfg_parse_first_layer(struct cfg *cfg)
         case YAML_SCALAR_EVENT:
             v = (char *)event.data.scalar.value;
             if (!strcmp(v, "ttl")) {
-                cfg->ttl = cfg_get_int(cfg, CFG_DEFAULT_TTL);
+                cfg->ttl = cfg_get_msec(cfg, CFG_DEFAULT_TTL);
             } else if (!strcmp(v, "workers")) {
                 cfg->workers = cfg_get_int(cfg, CFG_DEFAULT_WORKERS);
+            } else if (!strcmp(v, "rtu_threads")) {
+                cfg->rtu_threads = cfg_get_int(cfg, 1);
+                if (cfg->rtu_threads < 1 || cfg->rtu_threads > MAX_RTU_THREADS) {
+                    cfg->err = INVALID_PARAM;
+                    fprintf(stderr, "Invalid RTU_THREADS (1..%d)\n", MAX_RTU_THREADS);
+                }
             } else if (!strcmp(v, "socket")) {
                 if (!(v = cfg_get_string(cfg, NULL, &event)))
                     break;
@@ -375,7 +507,10 @@ static void cfg_parse_first_layer(struct cfg *cfg)
             } else if (!strcmp(v, "baud")) {
                 if (!(v = cfg_get_string(cfg, NULL, &event)))
                     break;
-                cfg->baud = get_speed(v, B9600);
+                if ((cfg->baud = get_line(v)) < 0) {
+                    cfg->err = INVALID_PARAM;
+                    fprintf(stderr, "Invalid param BAUD: %s\n", v);
+                }
             }
             break;
 
@@ -404,8 +539,41 @@ static void cfg_parse_config(struct cfg *cfg)
 }
 #endif
 
+/* Compile slave maps of all RTUs into direct-indexed route table */
+static void cfg_compile_routes(struct cfg *cfg)
+{
+    struct route *routes;
+    struct rtu_desc *ri;
+    struct slave_map *mi;
+
+    if (cfg->err)
+        return;
+
+    routes = calloc(CFG_MAX_ROUTES, sizeof(struct route));
+
+    VFOREACH(cfg->rtu_list, ri) {
+        VFOREACH(ri->slave_id, mi) {
+            if (mi->src < 0 || mi->src >= CFG_MAX_ROUTES) {
+                cfg->err = INVALID_PARAM;
+                fprintf(stderr, "Invalid SRC slave_id %d\n", mi->src);
+                free(routes);
+                return;
+            }
+            if (routes[mi->src].rtu) {
+                fprintf(stderr, "SRC slave_id %d is already mapped, ignored\n", mi->src);
+                continue;
+            }
+            routes[mi->src].rtu = ri;
+            routes[mi->src].dst = mi->dst;
+        }
+    }
+
+    __atomic_store_n(&cfg->routes, routes, __ATOMIC_RELEASE);
+}
+
 void cfg_free(struct cfg *cfg)
 {
+    free(cfg->routes);
     free(cfg->sockfile);
     free(cfg);
 }
@@ -426,7 +594,8 @@ struct cfg *cfg_load(const char *fname)
     cfg->workers = 1; //CFG_DEFAULT_WORKERS;
     cfg->ttl = CFG_DEFAULT_TTL;
     cfg->sockfile = strdup(CFG_DEFAULT_SOCKFILE);
-    VINIT(cfg->wbq);
+    cfg->rtu_threads = 1;
+    cfg->baud = CS8 | B9600;
 
 #ifndef _NUTTX_BUILD
     yaml_parser_initialize(&cfg->parser);
@@ -442,8 +611,10 @@ struct cfg *cfg_load(const char *fname)
       struct rtu_desc r;
       struct slave_map map;
       memset(&r, 0, sizeof(struct rtu_desc));
+      r.thread = -1;
       VINIT(r.slave_id);
       VINIT(r.q);
+      page_cache_init(&r.cache);
       r.type = RTU;
       r.timeout = RTU_TIMEOUT;
       r.cfg.serial.devname = strdup("/dev/ttyS1");
@@ -457,6 +628,9 @@ struct cfg *cfg_load(const char *fname)
     }
 #endif
 
+    /* RTU list is not reallocated anymore, pointers are safe */
+    cfg_compile_routes(cfg);
+
     if (cfg->err) {
         cfg_free(cfg);
         cfg = NULL;
@@ -5,9 +5,10 @@
 #include "mbus-gw.h"
 
 #define CFG_MAX_RETRIES      10
-#define CFG_DEFAULT_TTL      3
+#define CFG_DEFAULT_TTL      3000    /* msec */
 #define CFG_DEFAULT_WORKERS  4
 #define CFG_DEFAULT_SOCKFILE "/tmp/mbus-gw.sock"
+#define CFG_MAX_ROUTES       256
 
 enum err {
     CFG_OK = 0,
@@ -18,12 +19,17 @@ enum err {
 };
 
 struct cfg {
-    int ttl;
+    int ttl;                /* cache TTL, msec */
     int baud;
     int workers;
     char *sockfile;
     rtu_desc_v rtu_list;
-    writeback_v wbq;
+    struct route *routes;   /* slave_id -> RTU table, CFG_MAX_ROUTES entries */
+    int rtu_threads;
+    struct rtu_sched *sched; /* rtu_threads, `rtu_threads' entries */
+    struct workers *wk;     /* tcp_threads, `workers' entries */
+    int maxconns;
+    struct conn *conns;     /* client connections indexed by fd */
     enum err err;
     yaml_parser_t parser;
 };
@@ -31,5 +37,19 @@ struct cfg {
 extern struct cfg *cfg_load(const char *fname);
 extern void cfg_free(struct cfg *cfg);
 
+/*
+ * Route table is published by a single pointer store,
+ * so it can be replaced without locking the readers.
+ */
+static inline struct route *cfg_route(struct cfg *cfg, int slave_id)
+{
+    struct route *r = __atomic_load_n(&cfg->routes, __ATOMIC_ACQUIRE);
+
+    if (!r || slave_id < 0 || slave_id >= CFG_MAX_ROUTES || !r[slave_id].rtu)
+        return NULL;
+
+    return &r[slave_id];
+}
+
 #endif /* _CONFIG__H */
 
@@ -6,6 +6,12 @@
 #include <pthread.h>
 #include <sys/time.h>
 #include "vect.h"
+#include "timer.h"
+#include "cache.h"
+#include "image.h"
+#include "ring.h"
+#include "pool.h"
+#include "stats.h"
 
 #undef DEBUG
 //#define DEBUG
@@ -15,11 +21,62 @@
 #define DEBUGF(x...) do { } while(0);
 #endif
 
+#ifdef _NUTTX_BUILD
+#define pthread_rwlock_t          pthread_mutex_t
+#define pthread_rwlock_init(x, y) pthread_mutex_init(x, y)
+#define pthread_rwlock_destroy(x) pthread_mutex_destroy(x)
+#define pthread_rwlock_rdlock(x)  pthread_mutex_lock(x)
+#define pthread_rwlock_wrlock(x)  pthread_mutex_lock(x)
+#define pthread_rwlock_unlock(x)  pthread_mutex_unlock(x)
+#endif
+
 #define BUF_SIZE        512
 #define MAX_EVENTS      1024
 #define MODBUS_TCP_PORT 502
-#define RTU_TIMEOUT     3
+#define RTU_TIMEOUT     3000    /* msec */
+#define QUERY_EXPIRE    240000  /* msec, query lifetime in the queue */
 #define CACHE_TTL       1
+#define RTU_TICK        100     /* msec, scheduler poll period without timerfd */
+#define RTU_RX_FIFO     16      /* chars, UART delivers the answer in bursts of FIFO size */
+#define RTU_RX_LATENCY  5000    /* usec, scheduling slack of the character timeout */
+#define RESP_RETRY      1000    /* usec, retry of the answers held while the ring is full */
+#define MAX_QUEUE       150     /* queries scheduled per RTU */
+#ifdef _NUTTX_BUILD
+#define LISTEN_BACKLOG  8
+#else
+#define LISTEN_BACKLOG  512     /* reconnect storms of the clients */
+#endif
+#ifdef _NUTTX_BUILD
+#define MAX_RTU_THREADS 4
+#else
+#define MAX_RTU_THREADS 64      /* fits the wakeup mask of queue_batch() */
+#endif
+#define MAX_QUEUE_WAIT  (MAX_QUEUE * 8) /* including queries waiting for the same read */
+#define MAX_READ_BITS   2000    /* coils and discrete inputs per read */
+#define MAX_READ_REGS   125     /* registers per read */
+#define MBAP_FRAME_MAX  260     /* MBAP header + PDU */
+#define TID_MAP_SIZE    128     /* in-flight TCP transactions lookup */
+#define TID_MAP_MASK    (TID_MAP_SIZE - 1)
+#define MAX_WINDOW      (TID_MAP_SIZE / 2)
+#ifdef _NUTTX_BUILD
+#define MAX_CONNS       64
+#define CONN_OBUF_MAX   4096    /* max answer bytes pending to the client */
+#else
+#define MAX_CONNS       65536
+#define CONN_OBUF_MAX   (1 << 20)
+#endif
+#define CONN_OBUF_MIN   512
+#ifdef _NUTTX_BUILD
+#define CONN_IBUF_SIZE  512     /* partial requests of the client */
+#define MAX_BATCH       16      /* requests passed to RTUs at once */
+#define SUBMIT_RING     32      /* queries submitted to RTU and not taken yet */
+#define RESP_RING       64      /* answers posted to tcp_thread and not sent yet */
+#else
+#define CONN_IBUF_SIZE  4096
+#define MAX_BATCH       64
+#define SUBMIT_RING     1024
+#define RESP_RING       4096
+#endif
 
 #ifndef SUN_LEN
 #define SUN_LEN(ptr) ((size_t) (((struct sockaddr_un *) 0)->sun_path) + strlen ((ptr)->sun_path))
@@ -36,41 +93,80 @@ enum rtu_type {
 #endif
 };
 
-struct cache_page {
-    uint8_t status;        /* 0 - ok, 1 - timeout, 2 - NA */
-    uint8_t slaveid;
-    uint16_t addr;
-    uint16_t function;
-    uint16_t len;
-    time_t ttd;             /* time to die of the page: last_timestamp + TTL */
-    uint8_t *buf;
-    struct cache_page *next;
-    struct cache_page *prev;
-};
-
 struct queue_list {
     int resp_fd;            /* "response to" descriptor */
+    uint32_t resp_gen;      /* generation of the connection at resp_fd */
+    int resp_worker;        /* tcp_thread serving resp_fd */
     uint8_t *buf;           /* request buffer */
     size_t len;             /* request length */
-    time_t stamp;           /* timestamp of timeout: last_timestamp + timeout */
-    time_t expire;          /* timestamp of query expiration: last_timestamp + timeout */
+    uint64_t stamp;         /* timestamp of timeout: last_timestamp + timeout, msec */
+    uint64_t expire;        /* timestamp of query expiration, msec */
+    uint64_t sent;          /* time the request is written to RTU, usec */
+    struct timer timer;     /* nearest of `stamp' and `expire' */
     int16_t src;            /* source slave_id */
     uint8_t tido[2];
     uint8_t function;
     uint8_t answered;
     uint8_t requested;
+    uint8_t nomerge;        /* don't merge into other reads */
+    uint16_t span_addr;     /* range of the read actually requested */
+    uint16_t span_nb;
+    struct queue_list *lead; /* query whose read covers this one */
+    struct mbuf *answer;    /* answer PDU kept till the query is removed */
 };
 
-struct writeback {
-    int ep;                 /* epoll descriptor */
-    int fd;                 /* "response to" descriptor */
-    uint8_t *buf;           /* request buffer */
-    size_t len;             /* request length */
+enum timer_type {
+    TIMER_NONE,
+    TIMER_QUERY,
+    TIMER_PAGE,
+};
+
+typedef VECT(struct queue_list *) queue_list_v;
+
+/* Request parsed from the client stream */
+struct mbap_req {
+    const uint8_t *buf;
+    int len;
+    struct route *rt;
+    struct rtu_desc *rtu;   /* NULL once the request is processed */
+};
+
+/* Answer posted by rtu_thread to the tcp_thread of the client */
+struct resp {
+    int fd;
+    uint32_t gen;
+    uint8_t hdr[7];         /* MBAP header of the client */
+    struct mbuf *pdu;       /* shared answer, referenced by the entry */
+    struct resp *next;      /* answers held by rtu_thread, the ring is full */
+};
+
+struct conn {
+    pthread_mutex_t lock;
+    int ep;                 /* epoll descriptor of the serving tcp_thread */
+    int worker;             /* index of the serving tcp_thread */
+    uint32_t gen;           /* bumped on close, answers to stale queries are dropped */
+    int armed;              /* EPOLLOUT is watched */
+    int local;              /* accepted on the UNIX socket, takes commands */
+    uint8_t *obuf;          /* ring of answer bytes pending to the client */
+    uint32_t osize;         /* ring size, power of 2 */
+    uint32_t ohead;         /* offset of the first pending byte */
+    uint32_t olen;          /* number of pending bytes */
+    uint8_t *ibuf;          /* received bytes, owned by the serving tcp_thread */
+    uint32_t ilen;
 };
 
-typedef VECT(struct queue_list) queue_list_v;
+/* RTU descriptor channels, tag of the epoll events */
+enum rtu_chan_type {
+    CHAN_DATA,
+    CHAN_CMD,
+    CHAN_WAKEUP,            /* new queries are added */
+    CHAN_TIMER,             /* nearest deadline is reached */
+};
 
-typedef VECT(struct writeback) writeback_v;
+struct rtu_chan {
+    struct rtu_desc *rtu;
+    enum rtu_chan_type type;
+};
 
 struct slave_map {
     int16_t src;
@@ -79,10 +175,17 @@ struct slave_map {
 
 typedef VECT(struct slave_map) slave_map_v;
 
+struct route {
+    struct rtu_desc *rtu;   /* RTU serving the slave_id, NULL if not mapped */
+    int16_t dst;            /* slave_id on the RTU side */
+};
+
 struct rtu_desc {
     int fd;                 /* ttySx descriptior */
     int retries;            /* number of retries */
-    long timeout;           /* timeout in seconds */
+    long timeout;           /* timeout in msec */
+    int merge_gap;          /* max gap between merged reads, -1 disables merging */
+    int window;             /* max transactions in flight for Modbus-TCP */
     int baud;               /* global baud rate */
     enum rtu_type type;     /* endpoint RTU device type */
     uint16_t tid;
@@ -113,13 +216,28 @@ struct rtu_desc {
     } cfg;
 
     /* Master-related stuff */
+    pthread_rwlock_t lock;  /* protects cache pages and register images */
+    struct ring sq;         /* queries submitted by tcp_threads */
+    struct rtu_chan chan[CHAN_CMD + 1]; /* epoll_event.data.ptr for descriptors */
     uint8_t tido[2];
-    queue_list_v q;         /* queue list */
-    struct cache_page *p;   /* cache pages */
+    int inflight;           /* number of TCP transactions in flight */
+    struct queue_list *tid_map[TID_MAP_SIZE]; /* in-flight queries by TID */
+    uint8_t rxbuf[BUF_SIZE]; /* partial TCP answers */
+    int rxlen;
+    queue_list_v q;         /* queue list, owned by rtu_thread */
+    struct page_cache cache; /* cache pages */
+    struct reg_image *image[256]; /* register images by slave_id */
     int16_t toread;      /* number of words (2-bytes) to read for RTU */
     int16_t toread_off;  /* number of words read */
     uint8_t *toreadbuf;  /* temporary buffer */
-    struct timeval tv;   /* last request/answer time */
+    uint64_t tv;         /* last serial line activity, monotonic usec */
+    uint32_t char_usec;  /* character time on the line, usec */
+    uint32_t frame_gap;  /* t3.5 silence between frames, usec */
+    uint32_t char_timeout; /* silence which breaks a partial answer, usec */
+    int thread;          /* rtu_thread from config, -1 picks it by hash */
+    struct rtu_sched *sched; /* serving rtu_thread */
+    struct timer_wheel *tw; /* timers of the serving rtu_thread */
+    struct stat_rtu *stat;  /* counters, written by the serving rtu_thread */
     struct cfg *conf;
 };
 
@@ -130,8 +248,33 @@ struct workers {
     int ep;
     pthread_t th;
     struct cfg *cfg;
+    struct ring rq;         /* answers posted by rtu_threads */
+    int evfd;               /* eventfd to wake up the thread on answers */
+    int sd;                 /* MODBUS-TCP listener of the thread */
+    int ud;                 /* UNIX listener shared by the threads */
+    int spare;              /* reserved descriptor to shed connections on EMFILE */
+    struct stat_worker *stat; /* counters of the thread */
+};
+
+/* RTU scheduler thread, serves its share of the endpoints */
+struct rtu_sched {
+    int n;
+    pthread_t th;
+    struct cfg *cfg;
+    int evfd;               /* eventfd to wake up the thread on queries */
+    int nrtu;               /* number of served endpoints */
+    uint8_t *wake;          /* tcp_threads having answers posted, `workers' entries */
+    struct resp **held;     /* answers not fitting the ring of the tcp_thread, in order */
+    struct resp **held_tail;
 };
 
+extern void crc16_init(void);
 extern uint16_t crc16(const uint8_t *data, int len);
+/* Implementations, exported for the benchmark */
+extern uint16_t crc16_byte(const uint8_t *data, int len);
+extern uint16_t crc16_slice4(const uint8_t *data, int len);
+#ifndef _NUTTX_BUILD
+extern uint16_t crc16_slice8(const uint8_t *data, int len);
+#endif
 
 #endif /* _MBUS_COMMON__H */
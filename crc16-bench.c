@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "common.h"
+
+/* Throughput of the CRC16 implementations over serial frame sizes */
+
+#define BENCH_BYTES (64 << 20)  /* bytes per size and implementation */
+
+static const struct {
+    const char *name;
+    uint16_t (*fn)(const uint8_t *data, int len);
+} impls[] = {
+    { "byte", crc16_byte },
+    { "slice4", crc16_slice4 },
+    { "slice8", crc16_slice8 },
+    { "crc16", crc16 },
+};
+
+#define NIMPLS  (sizeof(impls) / sizeof(impls[0]))
+
+int main(int argc, char *argv[])
+{
+    static const int sizes[] = { 8, 16, 32, 64, 128, 256 };
+    uint8_t frame[256];
+    volatile uint16_t sink = 0;
+    int i, s, n;
+
+    crc16_init();
+
+    for (i = 0; i < sizeof(frame); ++i)
+        frame[i] = rand();
+
+    /* All of them have to agree first */
+    for (n = 0; n <= sizeof(frame); ++n) {
+        for (i = 1; i < NIMPLS; ++i) {
+            if (impls[i].fn(frame, n) != crc16_byte(frame, n)) {
+                printf("%s: mismatch at %d bytes\n", impls[i].name, n);
+                return 1;
+            }
+        }
+    }
+
+    printf("%6s", "size");
+    for (i = 0; i < NIMPLS; ++i)
+        printf(" %10s", impls[i].name);
+    printf("   (MB/s)\n");
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+        int len = sizes[s];
+        int iters = BENCH_BYTES / len;
+
+        printf("%6d", len);
+        for (i = 0; i < NIMPLS; ++i) {
+            struct timespec t0, t1;
+            double sec;
+
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            for (n = 0; n < iters; ++n) {
+                /* Feed the result back, calls can't be overlapped */
+                frame[0] = sink;
+                sink = impls[i].fn(frame, len);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+
+            sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+            printf(" %10.1f", (double)iters * len / sec / 1e6);
+        }
+        printf("\n");
+    }
+
+    return 0;
+}
@@ -35,13 +35,85 @@ static const uint16_t crc_table[] = {
 0X8201, 0X42C0, 0X4380, 0X8341, 0X4100, 0X81C1, 0X8081, 0X4040,
 };
 
-uint16_t crc16(const uint8_t *data, int len)
-{
-    uint16_t crc = 0xffff;
+/*
+ * Slicing tables: crc_slice[k][b] is the CRC of byte `b' followed by
+ * `k' zero bytes, so N bytes are folded with N lookups at once.
+ */
+#ifdef _NUTTX_BUILD
+#define CRC_SLICES  4
+#else
+#define CRC_SLICES  8
+#endif
+
+static uint16_t crc_slice[CRC_SLICES][256];
 
+static inline uint16_t crc16_tail(uint16_t crc, const uint8_t *data, int len)
+{
     while (len--)
     {
         crc = (crc >> 8) ^ crc_table[(crc ^ *data++) & 0xff];
     }
-    return crc & 0xffff;
+    return crc;
+}
+
+uint16_t crc16_byte(const uint8_t *data, int len)
+{
+    return crc16_tail(0xffff, data, len);
+}
+
+uint16_t crc16_slice4(const uint8_t *data, int len)
+{
+    uint16_t crc = 0xffff;
+
+    for (; len >= 4; len -= 4, data += 4) {
+        crc ^= data[0] | (data[1] << 8);
+        crc = crc_slice[3][crc & 0xff] ^ crc_slice[2][crc >> 8] ^
+              crc_slice[1][data[2]] ^ crc_slice[0][data[3]];
+    }
+    return crc16_tail(crc, data, len);
+}
+
+#if CRC_SLICES >= 8
+uint16_t crc16_slice8(const uint8_t *data, int len)
+{
+    uint16_t crc = 0xffff;
+
+    for (; len >= 8; len -= 8, data += 8) {
+        crc ^= data[0] | (data[1] << 8);
+        crc = crc_slice[7][crc & 0xff] ^ crc_slice[6][crc >> 8] ^
+              crc_slice[5][data[2]] ^ crc_slice[4][data[3]] ^
+              crc_slice[3][data[4]] ^ crc_slice[2][data[5]] ^
+              crc_slice[1][data[6]] ^ crc_slice[0][data[7]];
+    }
+    return crc16_tail(crc, data, len);
+}
+#endif
+
+/* Byte-wise lookup till crc16_init() builds the slicing tables */
+static uint16_t (*crc16_fn)(const uint8_t *data, int len) = crc16_byte;
+
+/* Called once before the threads are started */
+void crc16_init(void)
+{
+    int i, k;
+
+    for (i = 0; i < 256; ++i) {
+        crc_slice[0][i] = crc_table[i];
+        for (k = 1; k < CRC_SLICES; ++k)
+            crc_slice[k][i] = (crc_slice[k - 1][i] >> 8) ^ crc_table[crc_slice[k - 1][i] & 0xff];
+    }
+
+#if CRC_SLICES >= 8
+    crc16_fn = crc16_slice8;
+#else
+    crc16_fn = crc16_slice4;
+#endif
+}
+
+uint16_t crc16(const uint8_t *data, int len)
+{
+    /* Shorter data does not fill a slice */
+    if (len < 8)
+        return crc16_byte(data, len);
+    return crc16_fn(data, len);
 }
@@ -0,0 +1,138 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "image.h"
+
+/* Read functions store bits, the rest of tables hold 16-bit registers */
+#define REG_BITS(table)     ((table) < 2)
+
+/* Table of the function: 0 - coils, 1 - discrete inputs, 2 - holding, 3 - input registers */
+static int reg_table_of(int func)
+{
+    switch (func) {
+    case 1: case 5: case 15:
+        return 0;
+    case 2:
+        return 1;
+    case 3: case 6: case 16: case 22: case 23:
+        return 2;
+    case 4:
+        return 3;
+    }
+
+    return -1;
+}
+
+/* Byte count of the answer data for `nb' items */
+static int reg_bytes(int table, int nb)
+{
+    return REG_BITS(table) ? (nb + 7) / 8 : nb * 2;
+}
+
+static int reg_range_ok(int addr, int nb)
+{
+    return nb > 0 && addr >= 0 && addr + nb <= 0x10000;
+}
+
+/*
+ * Assemble answer data (without byte count) of the read request.
+ * Returns data length, -1 if any item is missing or expired.
+ */
+int reg_image_read(struct reg_image *img, int func, int addr, int nb,
+                   uint64_t now, uint8_t *data, size_t size)
+{
+    struct reg_table *t;
+    int table = reg_table_of(func);
+    int len;
+    int i;
+
+    if (!img || table < 0 || func > 4 || !reg_range_ok(addr, nb))
+        return -1;
+
+    len = reg_bytes(table, nb);
+    if (len > 0xff || len > size || !(t = img->table[table]))
+        return -1;
+
+    if (REG_BITS(table))
+        memset(data, 0, len);
+
+    for (i = 0; i < nb; ++i) {
+        int a = addr + i;
+        struct reg_chunk *c = t->chunk[a >> REG_CHUNK_BITS];
+        int o = a & (REG_CHUNK_SIZE - 1);
+
+        if (!c || !(c->valid & (1ULL << o)) || c->ttd[o] <= now)
+            return -1;
+
+        if (REG_BITS(table)) {
+            if (c->val[o])
+                data[i / 8] |= 1 << (i % 8);
+        } else {
+            data[i * 2] = c->val[o] >> 8;
+            data[i * 2 + 1] = c->val[o] & 0xff;
+        }
+    }
+
+    return len;
+}
+
+/*
+ * Store answer data (without byte count) of the read request.
+ * Returns 0 on success, -1 if the data doesn't match the request.
+ */
+int reg_image_update(struct reg_image **img, int func, int addr, int nb,
+                     const uint8_t *data, size_t len, uint64_t ttd)
+{
+    struct reg_table *t;
+    int table = reg_table_of(func);
+    int i;
+
+    if (table < 0 || func > 4 || !reg_range_ok(addr, nb) || len != reg_bytes(table, nb))
+        return -1;
+
+    if (!*img && !(*img = calloc(1, sizeof(struct reg_image))))
+        return -1;
+    if (!(t = (*img)->table[table]) && !(t = (*img)->table[table] = calloc(1, sizeof(struct reg_table))))
+        return -1;
+
+    for (i = 0; i < nb; ++i) {
+        int a = addr + i;
+        struct reg_chunk *c = t->chunk[a >> REG_CHUNK_BITS];
+        int o = a & (REG_CHUNK_SIZE - 1);
+
+        if (!c && !(c = t->chunk[a >> REG_CHUNK_BITS] = calloc(1, sizeof(struct reg_chunk))))
+            return -1;
+
+        if (REG_BITS(table))
+            c->val[o] = (data[i / 8] >> (i % 8)) & 1;
+        else
+            c->val[o] = (data[i * 2] << 8) | data[i * 2 + 1];
+        c->ttd[o] = ttd;
+        c->valid |= 1ULL << o;
+    }
+
+    return 0;
+}
+
+/* Forget items changed by the write request */
+void reg_image_invalidate(struct reg_image *img, int func, int addr, int nb)
+{
+    struct reg_table *t;
+    int table = reg_table_of(func);
+    int i;
+
+    /* Single item writes carry the value instead of the quantity */
+    if (func == 5 || func == 6 || func == 22)
+        nb = 1;
+
+    if (!img || table < 0 || !reg_range_ok(addr, nb) || !(t = img->table[table]))
+        return;
+
+    for (i = 0; i < nb; ++i) {
+        int a = addr + i;
+        struct reg_chunk *c = t->chunk[a >> REG_CHUNK_BITS];
+
+        if (c)
+            c->valid &= ~(1ULL << (a & (REG_CHUNK_SIZE - 1)));
+    }
+}
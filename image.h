@@ -0,0 +1,37 @@
+#ifndef _MBUS_IMAGE__H
+#define _MBUS_IMAGE__H 1
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Register image of the slave: last read values of coils, discrete
+ * inputs, holding and input registers with per-item expiration.
+ * Items are kept in lazily allocated chunks of 64.
+ */
+#define REG_CHUNK_BITS      6
+#define REG_CHUNK_SIZE      (1 << REG_CHUNK_BITS)
+#define REG_CHUNKS          (0x10000 >> REG_CHUNK_BITS)
+#define REG_TABLES          4
+
+struct reg_chunk {
+    uint64_t valid;                 /* bitmap of cached items */
+    uint64_t ttd[REG_CHUNK_SIZE];   /* time to die of the item, msec */
+    uint16_t val[REG_CHUNK_SIZE];   /* register value or coil state */
+};
+
+struct reg_table {
+    struct reg_chunk *chunk[REG_CHUNKS];
+};
+
+struct reg_image {
+    struct reg_table *table[REG_TABLES];
+};
+
+extern int reg_image_read(struct reg_image *img, int func, int addr, int nb,
+                          uint64_t now, uint8_t *data, size_t size);
+extern int reg_image_update(struct reg_image **img, int func, int addr, int nb,
+                            const uint8_t *data, size_t len, uint64_t ttd);
+extern void reg_image_invalidate(struct reg_image *img, int func, int addr, int nb);
+
+#endif /* _MBUS_IMAGE__H */
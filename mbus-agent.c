@@ -70,7 +70,9 @@ void *rtu_thread(void *arg)
         /* Process RTU data */
         for (n = 0; n < nfds; ++n) {
             int len;
+            struct rtu_chan *ch = evs[n].data.ptr;
 
+            ri = ch->rtu;
             if (!(evs[n].events & EPOLLIN)) {
                 if (evs[n].events & EPOLLHUP) {
                     goto reconnect;
@@ -81,7 +83,7 @@ void *rtu_thread(void *arg)
                 continue;
             }
 
-            len = read(evs[n].data.fd, buf, BUF_SIZE);
+            len = read(ch->type == CHAN_CMD ? ri->cfg.realcom.cmdfd : ri->fd, buf, BUF_SIZE);
             if (len <= 0) {
 reconnect:
                 /* TODO: reset "retries" counters after a delay */
@@ -92,11 +94,11 @@ reconnect:
                 rtu_open(ri, ep);
                 continue;
             }
-            DEBUGF("Read %d from %d\n", len, evs[n].data.fd);
+            DEBUGF("Read %d from %d\n", len, ri->fd);
 
             /* Process RealCOM command */
-            if (ri->type == REALCOM && ri->fd != evs[n].data.fd) {
-                printf("Process CMD %d (%d,%d)\n", len, ri->fd, evs[n].data.fd);
+            if (ch->type == CHAN_CMD) {
+                printf("Process CMD %d (%d,%d)\n", len, ri->fd, ri->cfg.realcom.cmdfd);
                 realcom_process_cmd(ri, buf, len);
                 continue;
             }
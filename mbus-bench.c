@@ -0,0 +1,738 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include "common.h"
+#include "rtu.h"
+
+/*
+ * Load generator and simulated slaves for mbus-gw:
+ *
+ *   mbus-bench load  - Modbus-TCP clients, reports latency percentiles
+ *   mbus-bench slave - Modbus-TCP slave and/or serial RTU slave on a pty
+ */
+
+#define BENCH_MAX_CONNS 1024
+#define BENCH_MAX_DEPTH 256     /* requests in flight per connection */
+#define BENCH_BUF_SIZE  4096
+#define BENCH_DRAIN     5000000 /* usec, wait for answers after the run */
+
+/* Log-linear latency histogram, 1/32 precision as HDR histogram has */
+#define HIST_SUB_BITS   5
+#define HIST_SUB        (1 << HIST_SUB_BITS)
+#define HIST_SIZE       (64 << HIST_SUB_BITS)
+
+struct hist {
+    uint64_t count[HIST_SIZE];
+    uint64_t total;
+    uint64_t max;
+};
+
+static int hist_index(uint64_t v)
+{
+    int msb;
+
+    if (v < HIST_SUB)
+        return v;
+    msb = 63 - __builtin_clzll(v);
+    return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+           ((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Lowest value of the bucket */
+static uint64_t hist_value(int idx)
+{
+    if (idx < HIST_SUB)
+        return idx;
+    return (uint64_t)(HIST_SUB | (idx & (HIST_SUB - 1))) << ((idx >> HIST_SUB_BITS) - 1);
+}
+
+static void hist_add(struct hist *h, uint64_t v)
+{
+    h->count[hist_index(v)]++;
+    h->total++;
+    if (v > h->max)
+        h->max = v;
+}
+
+static uint64_t hist_percentile(const struct hist *h, double p)
+{
+    uint64_t want = (uint64_t)(h->total * p / 100.0 + 0.5);
+    uint64_t seen = 0;
+    int i;
+
+    if (!want)
+        want = 1;
+    for (i = 0; i < HIST_SIZE; ++i) {
+        seen += h->count[i];
+        if (seen >= want)
+            return hist_value(i);
+    }
+    return h->max;
+}
+
+/* Parse "1,3,5-7" into the list of unit ids */
+static int parse_units(const char *s, uint8_t *units)
+{
+    int n = 0;
+    int lo, hi;
+    char *end;
+
+    while (*s) {
+        lo = hi = strtol(s, &end, 10);
+        if (*end == '-')
+            hi = strtol(end + 1, &end, 10);
+        if (end == s || lo < 0 || hi > 255 || lo > hi)
+            return -1;
+        while (lo <= hi && n < 256)
+            units[n++] = lo++;
+        if (*end == ',')
+            end++;
+        else if (*end)
+            return -1;
+        s = end;
+    }
+    return n;
+}
+
+/*
+ * Load generator
+ */
+struct bconn {
+    int fd;
+    uint16_t tid;
+    int inflight;
+    uint64_t stamp[BENCH_MAX_DEPTH]; /* send time by TID */
+    uint8_t rbuf[BENCH_BUF_SIZE];
+    int rlen;
+};
+
+struct load {
+    const char *host;
+    const char *port;
+    int conns;
+    int depth;
+    uint8_t units[256];
+    int nunits;
+    int write_pct;
+    int duration;
+    int addr;
+    int qty;
+    struct bconn *c;
+    struct hist lat;
+    uint64_t sent;
+    uint64_t exceptions;
+    uint64_t errors;
+};
+
+static int load_connect(struct load *l)
+{
+    struct addrinfo hints, *res;
+    int one = 1;
+    int fd;
+    int rc;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((rc = getaddrinfo(l->host, l->port, &hints, &res)) != 0) {
+        printf("getaddrinfo(%s): %s\n", l->host, gai_strerror(rc));
+        return -1;
+    }
+
+    fd = socket(res->ai_family, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+        perror("connect() failed");
+        if (fd >= 0)
+            close(fd);
+        fd = -1;
+    } else {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    freeaddrinfo(res);
+
+    return fd;
+}
+
+static int load_send(struct load *l, struct bconn *c)
+{
+    uint8_t req[12];
+    int addr = l->addr + rand() % l->qty;
+
+    c->tid++;
+    req[0] = c->tid >> 8;
+    req[1] = c->tid & 0xff;
+    req[2] = req[3] = 0;
+    req[4] = 0;
+    req[5] = 6;
+    req[6] = l->units[rand() % l->nunits];
+    if (rand() % 100 < l->write_pct) {
+        req[7] = 6;
+        req[8] = addr >> 8;
+        req[9] = addr & 0xff;
+        req[10] = addr >> 8;
+        req[11] = addr & 0xff;
+    } else {
+        req[7] = 3;
+        req[8] = l->addr >> 8;
+        req[9] = l->addr & 0xff;
+        req[10] = 0;
+        req[11] = l->qty;
+    }
+
+    c->stamp[c->tid % BENCH_MAX_DEPTH] = clock_usec();
+    if (write(c->fd, req, sizeof(req)) != sizeof(req)) {
+        perror("write() failed");
+        return -1;
+    }
+    c->inflight++;
+    l->sent++;
+
+    return 0;
+}
+
+/* Account complete answers, returns -1 if the connection is broken */
+static int load_read(struct load *l, struct bconn *c)
+{
+    uint64_t now;
+    int off = 0;
+    int len;
+
+    len = read(c->fd, c->rbuf + c->rlen, sizeof(c->rbuf) - c->rlen);
+    if (len <= 0)
+        return -1;
+    c->rlen += len;
+    now = clock_usec();
+
+    while (c->rlen - off >= 8) {
+        uint8_t *a = c->rbuf + off;
+        int flen = 6 + ((a[4] << 8) | a[5]);
+        uint16_t tid = (a[0] << 8) | a[1];
+
+        if (flen > sizeof(c->rbuf))
+            return -1;
+        if (c->rlen - off < flen)
+            break;
+
+        hist_add(&l->lat, now - c->stamp[tid % BENCH_MAX_DEPTH]);
+        if (a[7] & 0x80)
+            l->exceptions++;
+        c->inflight--;
+        off += flen;
+    }
+
+    memmove(c->rbuf, c->rbuf + off, c->rlen - off);
+    c->rlen -= off;
+
+    return 0;
+}
+
+static int bench_load(struct load *l)
+{
+    struct epoll_event ev, evs[64];
+    uint64_t start, stop, now;
+    int inflight;
+    int ep;
+    int i, n;
+
+    if (!(l->c = calloc(l->conns, sizeof(struct bconn))) ||
+        (ep = epoll_create(1)) < 0) {
+        perror("bench_load");
+        return 1;
+    }
+
+    for (i = 0; i < l->conns; ++i) {
+        if ((l->c[i].fd = load_connect(l)) < 0)
+            return 1;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &l->c[i];
+        epoll_ctl(ep, EPOLL_CTL_ADD, l->c[i].fd, &ev);
+    }
+
+    start = clock_usec();
+    stop = start + (uint64_t)l->duration * 1000000;
+    for (i = 0; i < l->conns; ++i) {
+        while (l->c[i].inflight < l->depth)
+            if (load_send(l, &l->c[i]) < 0)
+                return 1;
+    }
+
+    do {
+        n = epoll_wait(ep, evs, 64, 100);
+        now = clock_usec();
+        for (i = 0; i < n; ++i) {
+            struct bconn *c = evs[i].data.ptr;
+
+            if (load_read(l, c) < 0) {
+                printf("Connection #%d closed, %d requests lost\n", c->fd, c->inflight);
+                l->errors += c->inflight;
+                c->inflight = 0;
+                epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, NULL);
+                close(c->fd);
+                c->fd = -1;
+                continue;
+            }
+            while (now < stop && c->inflight < l->depth)
+                if (load_send(l, c) < 0)
+                    return 1;
+        }
+
+        for (inflight = 0, i = 0; i < l->conns; ++i)
+            inflight += l->c[i].inflight;
+    } while (now < stop || (inflight && now < stop + BENCH_DRAIN));
+
+    l->errors += inflight;
+    now -= start;
+
+    printf("requests %llu answers %llu exceptions %llu lost %llu\n",
+           (unsigned long long)l->sent, (unsigned long long)l->lat.total,
+           (unsigned long long)l->exceptions, (unsigned long long)l->errors);
+    printf("rate %.0f req/s over %d connections, depth %d\n",
+           l->lat.total * 1e6 / now, l->conns, l->depth);
+    printf("latency usec: p50 %llu p90 %llu p99 %llu p99.9 %llu max %llu\n",
+           (unsigned long long)hist_percentile(&l->lat, 50),
+           (unsigned long long)hist_percentile(&l->lat, 90),
+           (unsigned long long)hist_percentile(&l->lat, 99),
+           (unsigned long long)hist_percentile(&l->lat, 99.9),
+           (unsigned long long)l->lat.max);
+
+    return l->errors ? 1 : 0;
+}
+
+/*
+ * Simulated slaves, every unit id has the same registers:
+ * holding register N is N till written, input register N is N + 1000,
+ * coil and discrete input N are set if N % 3 == 0.
+ */
+static uint16_t regs[65536];
+
+/* Answer PDU to the request PDU, returns its length */
+static int slave_pdu(const uint8_t *req, int len, uint8_t *ans)
+{
+    int addr = (req[1] << 8) | req[2];
+    int qty = (req[3] << 8) | req[4];
+    int waddr, wqty;
+    int i;
+
+    ans[0] = req[0];
+    if (len < 5)
+        goto illegal_value;
+
+    switch (req[0]) {
+    case 1:
+    case 2:
+        if (qty < 1 || qty > MAX_READ_BITS)
+            goto illegal_value;
+        ans[1] = (qty + 7) / 8;
+        memset(ans + 2, 0, ans[1]);
+        for (i = 0; i < qty; ++i) {
+            if ((addr + i) % 3 == 0)
+                ans[2 + i / 8] |= 1 << (i % 8);
+        }
+        return 2 + ans[1];
+    case 3:
+    case 4:
+        if (qty < 1 || qty > MAX_READ_REGS)
+            goto illegal_value;
+        ans[1] = qty * 2;
+        for (i = 0; i < qty; ++i) {
+            uint16_t v = req[0] == 3 ? regs[(addr + i) & 0xffff] : addr + i + 1000;
+
+            ans[2 + i * 2] = v >> 8;
+            ans[3 + i * 2] = v & 0xff;
+        }
+        return 2 + ans[1];
+    case 6:
+        regs[addr] = qty;
+        /* fall through */
+    case 5:
+    case 15:
+        memcpy(ans, req, 5);
+        return 5;
+    case 16:
+        if (qty < 1 || len < 6 + qty * 2)
+            goto illegal_value;
+        for (i = 0; i < qty; ++i)
+            regs[(addr + i) & 0xffff] = (req[6 + i * 2] << 8) | req[7 + i * 2];
+        memcpy(ans, req, 5);
+        return 5;
+    case 23:
+        /* Write part goes first, the read sees its values */
+        if (qty < 1 || qty > MAX_READ_REGS || len < 10)
+            goto illegal_value;
+        waddr = (req[5] << 8) | req[6];
+        wqty = (req[7] << 8) | req[8];
+        if (wqty < 1 || len < 10 + wqty * 2)
+            goto illegal_value;
+        for (i = 0; i < wqty; ++i)
+            regs[(waddr + i) & 0xffff] = (req[10 + i * 2] << 8) | req[11 + i * 2];
+        ans[1] = qty * 2;
+        for (i = 0; i < qty; ++i) {
+            ans[2 + i * 2] = regs[(addr + i) & 0xffff] >> 8;
+            ans[3 + i * 2] = regs[(addr + i) & 0xffff] & 0xff;
+        }
+        return 2 + ans[1];
+    }
+
+    ans[0] |= 0x80;
+    ans[1] = 0x01;
+    return 2;
+
+illegal_value:
+    ans[0] |= 0x80;
+    ans[1] = 0x03;
+    return 2;
+}
+
+struct sconn {
+    uint8_t rbuf[BENCH_BUF_SIZE];
+    int rlen;
+};
+
+struct slave {
+    int port;
+    const char *link;
+    int baud;
+    int bits;               /* per character, start and stop bits included */
+    int delay;              /* usec, turnaround of the slave */
+    uint32_t char_usec;
+    int lfd;
+    int pty;
+    struct sconn *conns[BENCH_MAX_CONNS];
+    /* Serial line is half-duplex, one answer at a time */
+    uint8_t sbuf[BENCH_BUF_SIZE];
+    int slen;
+    uint8_t pend[RTU_FRAME_MAX];
+    int pend_len;
+    uint64_t pend_due;
+    uint64_t requests;
+};
+
+static int slave_tcp_read(struct slave *s, int fd)
+{
+    struct sconn *c = s->conns[fd];
+    uint8_t ans[BUF_SIZE];
+    int off = 0;
+    int len;
+
+    len = read(fd, c->rbuf + c->rlen, sizeof(c->rbuf) - c->rlen);
+    if (len <= 0)
+        return -1;
+    c->rlen += len;
+
+    while (c->rlen - off >= 8) {
+        uint8_t *r = c->rbuf + off;
+        int flen = 6 + ((r[4] << 8) | r[5]);
+        int alen;
+
+        if (flen > BUF_SIZE)
+            return -1;
+        if (c->rlen - off < flen)
+            break;
+
+        memcpy(ans, r, 7);
+        alen = slave_pdu(r + 7, flen - 7, ans + 7) + 1;
+        ans[4] = alen >> 8;
+        ans[5] = alen & 0xff;
+        if (write(fd, ans, alen + 6) != alen + 6)
+            return -1;
+        s->requests++;
+        off += flen;
+    }
+
+    memmove(c->rbuf, c->rbuf + off, c->rlen - off);
+    c->rlen -= off;
+
+    return 0;
+}
+
+/* Answer the next complete request of the serial line */
+static void slave_rtu_frames(struct slave *s)
+{
+    uint16_t crc;
+    int flen;
+
+    while (s->slen >= 8 && !s->pend_len) {
+        if (s->sbuf[1] == 23) {
+            if (s->slen < 11)
+                break;
+            flen = 13 + s->sbuf[10];
+        } else {
+            flen = (s->sbuf[1] == 15 || s->sbuf[1] == 16) ? 9 + s->sbuf[6] : 8;
+        }
+        if (s->slen < flen)
+            break;
+
+        memcpy(&crc, s->sbuf + flen - 2, 2);
+        if (crc != crc16(s->sbuf, flen - 2)) {
+            printf("Bad CRC, %d bytes dropped\n", s->slen);
+            s->slen = 0;
+            break;
+        }
+
+        s->pend[0] = s->sbuf[0];
+        s->pend_len = slave_pdu(s->sbuf + 1, flen - 3, s->pend + 1) + 1;
+        crc = crc16(s->pend, s->pend_len);
+        memcpy(s->pend + s->pend_len, &crc, 2);
+        s->pend_len += 2;
+
+        /* Request and answer take their time on the line */
+        s->pend_due = clock_usec() + s->delay + (flen + s->pend_len) * s->char_usec;
+        s->requests++;
+
+        memmove(s->sbuf, s->sbuf + flen, s->slen - flen);
+        s->slen -= flen;
+    }
+}
+
+static void slave_rtu_read(struct slave *s)
+{
+    int len;
+
+    len = read(s->pty, s->sbuf + s->slen, sizeof(s->sbuf) - s->slen);
+    if (len > 0) {
+        s->slen += len;
+        slave_rtu_frames(s);
+    }
+}
+
+static int slave_open_pty(struct slave *s)
+{
+    struct termios t;
+    char *name;
+    int fd;
+
+    if ((s->pty = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK)) < 0 ||
+        grantpt(s->pty) < 0 || unlockpt(s->pty) < 0 ||
+        !(name = ptsname(s->pty))) {
+        perror("posix_openpt() failed");
+        return -1;
+    }
+
+    /* Keep the slave side open, the gateway may reopen it */
+    if ((fd = open(name, O_RDWR | O_NOCTTY)) < 0) {
+        perror("open(pty) failed");
+        return -1;
+    }
+    tcgetattr(fd, &t);
+    cfmakeraw(&t);
+    tcsetattr(fd, TCSANOW, &t);
+
+    unlink(s->link);
+    if (symlink(name, s->link) < 0) {
+        perror("symlink() failed");
+        return -1;
+    }
+    printf("RTU slave on %s (%s), %d baud, %d bits\n", s->link, name, s->baud, s->bits);
+
+    return 0;
+}
+
+static int slave_listen(struct slave *s)
+{
+    struct sockaddr_in sa;
+    int one = 1;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(s->port);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if ((s->lfd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+        setsockopt(s->lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+        bind(s->lfd, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+        listen(s->lfd, LISTEN_BACKLOG) < 0) {
+        perror("listen() failed");
+        return -1;
+    }
+    printf("TCP slave on port %d\n", s->port);
+
+    return 0;
+}
+
+static int bench_slave(struct slave *s)
+{
+    struct epoll_event ev, evs[64];
+    uint64_t last = 0;
+    int ep;
+    int fd;
+    int i, n;
+
+    if ((ep = epoll_create(1)) < 0) {
+        perror("epoll_create() failed");
+        return 1;
+    }
+
+    for (i = 0; i < 65536; ++i)
+        regs[i] = i;
+
+    s->lfd = s->pty = -1;
+    if (s->port && slave_listen(s) < 0)
+        return 1;
+    if (s->link && slave_open_pty(s) < 0)
+        return 1;
+
+    ev.events = EPOLLIN;
+    if (s->lfd >= 0) {
+        ev.data.fd = s->lfd;
+        epoll_ctl(ep, EPOLL_CTL_ADD, s->lfd, &ev);
+    }
+    if (s->pty >= 0) {
+        ev.data.fd = s->pty;
+        epoll_ctl(ep, EPOLL_CTL_ADD, s->pty, &ev);
+    }
+
+    for (;;) {
+        int timeout = 1000;
+        uint64_t now = clock_usec();
+
+        if (s->pend_len)
+            timeout = s->pend_due > now ? (s->pend_due - now + 999) / 1000 : 0;
+
+        n = epoll_wait(ep, evs, 64, timeout);
+        for (i = 0; i < n; ++i) {
+            fd = evs[i].data.fd;
+            if (fd == s->lfd) {
+                if ((fd = accept(s->lfd, NULL, NULL)) < 0)
+                    continue;
+                if (fd >= BENCH_MAX_CONNS || !(s->conns[fd] = calloc(1, sizeof(struct sconn)))) {
+                    close(fd);
+                    continue;
+                }
+                ev.data.fd = fd;
+                epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+            } else if (fd == s->pty) {
+                slave_rtu_read(s);
+            } else if (slave_tcp_read(s, fd) < 0) {
+                epoll_ctl(ep, EPOLL_CTL_DEL, fd, NULL);
+                close(fd);
+                free(s->conns[fd]);
+                s->conns[fd] = NULL;
+            }
+        }
+
+        now = clock_usec();
+        if (s->pend_len && now >= s->pend_due) {
+            if (write(s->pty, s->pend, s->pend_len) != s->pend_len)
+                perror("write(pty) failed");
+            s->pend_len = 0;
+            /* Requests queued behind the answer */
+            slave_rtu_frames(s);
+        }
+
+        if (now - last >= 1000000) {
+            printf("requests %llu\n", (unsigned long long)s->requests);
+            fflush(stdout);
+            last = now;
+        }
+    }
+
+    return 0;
+}
+
+/* "<baud>[@<data bits><parity n/e/o><stop bits>]" */
+static int parse_line(struct slave *s, const char *v)
+{
+    int data = 8, stop = 1;
+    char parity = 'n';
+
+    if (sscanf(v, "%d@%1d%c%1d", &s->baud, &data, &parity, &stop) < 1 ||
+        s->baud <= 0 || data < 5 || data > 8 || stop < 1 || stop > 2 ||
+        !strchr("nNeEoO", parity))
+        return -1;
+
+    s->bits = 1 + data + (parity == 'n' || parity == 'N' ? 0 : 1) + stop;
+    s->char_usec = (s->bits * 1000000 + s->baud - 1) / s->baud;
+
+    return 0;
+}
+
+static void usage(void)
+{
+    printf("Usage:\n"
+           "  mbus-bench load [-H host] [-p port] [-c conns] [-d depth] [-u units]\n"
+           "                  [-w write%%] [-t seconds] [-a addr] [-q qty]\n"
+           "  mbus-bench slave [-p tcp-port] [-s pty-link] [-b baud[@8n1]] [-l usec]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+
+    signal(SIGPIPE, SIG_IGN);
+    crc16_init();
+
+    if (argc > 1 && !strcmp(argv[1], "load")) {
+        static struct load l;
+
+        l.host = "127.0.0.1";
+        l.port = "502";
+        l.conns = 8;
+        l.depth = 1;
+        l.units[0] = 1;
+        l.nunits = 1;
+        l.duration = 10;
+        l.qty = 10;
+
+        while ((opt = getopt(argc - 1, argv + 1, "H:p:c:d:u:w:t:a:q:")) != -1) {
+            switch (opt) {
+            case 'H': l.host = optarg; break;
+            case 'p': l.port = optarg; break;
+            case 'c': l.conns = atoi(optarg); break;
+            case 'd': l.depth = atoi(optarg); break;
+            case 'u': l.nunits = parse_units(optarg, l.units); break;
+            case 'w': l.write_pct = atoi(optarg); break;
+            case 't': l.duration = atoi(optarg); break;
+            case 'a': l.addr = atoi(optarg); break;
+            case 'q': l.qty = atoi(optarg); break;
+            default: usage(); return 1;
+            }
+        }
+        if (l.conns < 1 || l.conns > BENCH_MAX_CONNS ||
+            l.depth < 1 || l.depth > BENCH_MAX_DEPTH || l.nunits < 1 ||
+            l.qty < 1 || l.qty > MAX_READ_REGS || l.addr < 0 || l.addr + l.qty > 65536) {
+            usage();
+            return 1;
+        }
+        return bench_load(&l);
+    }
+
+    if (argc > 1 && !strcmp(argv[1], "slave")) {
+        static struct slave s;
+
+        parse_line(&s, "9600@8n1");
+        while ((opt = getopt(argc - 1, argv + 1, "p:s:b:l:")) != -1) {
+            switch (opt) {
+            case 'p': s.port = atoi(optarg); break;
+            case 's': s.link = optarg; break;
+            case 'b':
+                if (parse_line(&s, optarg) < 0) {
+                    usage();
+                    return 1;
+                }
+                break;
+            case 'l': s.delay = atoi(optarg); break;
+            default: usage(); return 1;
+            }
+        }
+        if (!s.port && !s.link) {
+            usage();
+            return 1;
+        }
+        return bench_slave(&s);
+    }
+
+    usage();
+    return 1;
+}
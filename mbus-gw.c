@@ -1,3 +1,6 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     /* accept4() */
+#endif
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,6 +10,7 @@
 #include <signal.h>
 #include <sys/wait.h>
 #include <sys/epoll.h>
+#include <sys/uio.h>
 #ifndef _NUTTX_BUILD
 #include <netinet/tcp.h>
 #include <netinet/in.h>
@@ -19,6 +23,12 @@
 #include <netdb.h>
 #include <pthread.h>
 #include <time.h>
+#ifndef _NUTTX_BUILD
+#include <sys/resource.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#endif
 
 #include "mbus-gw.h"
 #ifndef _NUTTX_BUILD
@@ -27,21 +37,13 @@
 #include "cfg.h"
 #include "rtu.h"
 
-#ifdef _NUTTX_BUILD
-#define pthread_rwlock_t          pthread_mutex_t
-#define pthread_rwlock_init(x, y) pthread_mutex_init(x, y)
-#define pthread_rwlock_destroy(x) pthread_mutex_destroy(x)
-#define pthread_rwlock_rdlock(x)  pthread_mutex_lock(x)
-#define pthread_rwlock_wrlock(x)  pthread_mutex_lock(x)
-#define pthread_rwlock_unlock(x)  pthread_mutex_unlock(x)
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE 0
 #endif
 
-#undef MAX_EVENTS
-#define MAX_EVENTS 3
-
-static pthread_rwlock_t rwlock;
-
-void _wbqueue_add(struct cfg *cfg, int fd, uint8_t *buf, int len);
+void wbqueue_addv(struct cfg *cfg, int fd, uint32_t gen, const uint8_t *hdr, int hlen,
+                  const uint8_t *body, int blen);
+void wbqueue_add(struct cfg *cfg, int fd, uint32_t gen, const uint8_t *buf, int len);
 
 static void dump(const uint8_t *buf, size_t len)
 {
@@ -73,55 +75,82 @@ static void dumpr(const uint8_t *buf, size_t len)
     printf("=== %d ===\n", len);
 }
 
+/* RTU list and slave maps are not changed after config is loaded */
 struct rtu_desc *rtu_by_slaveid(struct cfg *cfg, int slave_id)
 {
-    struct slave_map *mi;
-    struct rtu_desc *ri;
-    int rc;
+    struct route *rt = cfg_route(cfg, slave_id);
 
-    if ((rc = pthread_rwlock_rdlock(&rwlock)) != 0) {
-        printf("rtu_by_slaveid: rdlock=%d\n", rc);
-        return NULL;
-    }
-    VFOREACH(cfg->rtu_list, ri) {
-        VFOREACH(ri->slave_id, mi) {
-            if (mi->src == slave_id)
-                goto out;
-        }
+    return rt ? rt->rtu : NULL;
+}
+
+/* Parse (slave, function, address, quantity) of the upstream request */
+static void _query_tuple(struct rtu_desc *rtu, const struct queue_list *q,
+                         int *slave, int *func, int *addr, int *nb)
+{
+    const uint8_t *pdu = NULL;
+
+    /* TODO: handle different RTU types */
+    if (rtu->type == TCP)
+        pdu = q->buf + 6;
+    else if (rtu->type == RTU)
+        pdu = q->buf;
+
+    if (!pdu) {
+        *slave = *func = *addr = *nb = 0;
+        return;
     }
-    ri = NULL;
 
-out:
-    if (pthread_rwlock_unlock(&rwlock) != 0)
-        printf("rtu_by_slaveid: unlock FAILED\n");
+    *slave = pdu[0];
+    *func = pdu[1];
+    *addr = (pdu[2] << 8) | pdu[3];
+    *nb = (pdu[4] << 8) | pdu[5];
 
-    return ri;
+    /* Read/write registers changes the range of its write part */
+    if (*func == 23 && q->len >= (rtu->type == TCP ? 6 : 0) + 10) {
+        *addr = (pdu[6] << 8) | pdu[7];
+        *nb = (pdu[8] << 8) | pdu[9];
+    }
 }
 
-struct rtu_desc *rtu_by_fd(struct cfg *cfg, int fd)
+/* Same read of the same slave, the answer to one fits the other */
+static int _queue_same(struct rtu_desc *rtu, const struct queue_list *a, const struct queue_list *b)
 {
-    struct rtu_desc *ri;
-    int rc;
+    if (a->function < 1 || a->function > 4 || a->len != b->len)
+        return 0;
 
-    if ((rc = pthread_rwlock_rdlock(&rwlock)) != 0) {
-        printf("rtu_by_fd: rdlock=%d\n", rc);
-        return NULL;
-    }
-    VFOREACH(cfg->rtu_list, ri) {
-        if (ri->fd == fd
-#ifndef _NUTTX_BUILD
-            || (ri->type == REALCOM && ri->cfg.realcom.cmdfd == fd)
-#endif
-           )
-            goto out;
-    }
-    ri = NULL;
+    if (rtu->type == TCP)
+        return !memcmp(a->buf + 6, b->buf + 6, a->len - 6);
+    if (rtu->type == RTU)
+        return !memcmp(a->buf, b->buf, a->len - 2);
 
-out:
-    if (pthread_rwlock_unlock(&rwlock) != 0)
-        printf("rtu_by_fd: unlock FAILED\n");
+    return 0;
+}
 
-    return ri;
+/* Split the failed merged read back, the queries are requested one by one then */
+static int _queue_unmerge(struct rtu_desc *rtu, struct queue_list *q)
+{
+    struct queue_list **mp;
+    int slave, func, addr, nb;
+
+    _query_tuple(rtu, q, &slave, &func, &addr, &nb);
+    if (!q->span_nb || (q->span_addr == addr && q->span_nb == nb))
+        return 0;
+
+    DEBUGF("unmerge %p: span %d+%d\n", q, q->span_addr, q->span_nb);
+    VFOREACH(rtu->q, mp) {
+        /* Waiters for the same read keep waiting for it */
+        if ((*mp)->lead == q && !_queue_same(rtu, *mp, q)) {
+            (*mp)->lead = NULL;
+            (*mp)->nomerge = 1;
+        }
+    }
+    q->nomerge = 1;
+    q->span_nb = 0;
+    q->stamp = 0;
+    q->requested = 0;
+    timer_add(rtu->tw, &q->timer, q->expire);
+
+    return 1;
 }
 
 void _cache_update(struct rtu_desc *rtu, struct queue_list *q, const uint8_t *buf, size_t len)
@@ -131,8 +160,10 @@ void _cache_update(struct rtu_desc *rtu, struct queue_list *q, const uint8_t *bu
     int addr = 0;
     int nb = 0;
     int i;
+    const uint8_t *pdu;
+    int pdu_len;
+    uint64_t ttd;
     struct cache_page *p;
-    struct cache_page *new;
 
     if (!rtu || !q) {
         DEBUGF("rtu=%p qlen=%d\n", rtu, (rtu ? VLEN(rtu->q) : -1));
@@ -143,18 +174,7 @@ void _cache_update(struct rtu_desc *rtu, struct queue_list *q, const uint8_t *bu
     /* Check for function type */
     // ...
 
-    /* TODO: handle different RTU types */
-    if (rtu->type == TCP) {
-        slave = q->buf[6];
-        func = q->buf[7];
-        addr = (q->buf[8] << 8) | q->buf[9];
-        nb = (q->buf[10] << 8) | q->buf[11];
-    } else if (rtu->type == RTU) {
-        slave = q->buf[0];
-        func = q->buf[1];
-        addr = (q->buf[2] << 8) | q->buf[3];
-        nb = (q->buf[4] << 8) | q->buf[5];
-    }
+    _query_tuple(rtu, q, &slave, &func, &addr, &nb);
 
 #ifdef DEBUG
     printf("-- ");
@@ -183,81 +203,110 @@ void _cache_update(struct rtu_desc *rtu, struct queue_list *q, const uint8_t *bu
     /* For error response do not cache the answer, just write it back */
 //    if (buf[7] & 0x80)
 
-    if (!rtu->p) {
-        p = rtu->p = calloc(1, sizeof(struct cache_page));
-        DEBUGF("! p=%p\n", p);
-        p->next = NULL;
-        p->prev = NULL;
-    } else {
-        p = rtu->p;
-        while (p->next != NULL) {
-            if (func == p->function && slave == p->slaveid && addr == p->addr) {
-                /* Update page if it has the same constraints */
-                DEBUGF("=== update %p (%d,%d)\n", p, nb, p->len);
-                if (nb == ((buf[10] << 8) | buf[11])) //p->len)
-                    goto update;
-                break;
-            } else if ((addr > p->addr && slave == p->slaveid) || slave < p->slaveid) {
-                /* Insert before */
-                if (!p->prev) {
-                    rtu->p = calloc(1, sizeof(struct cache_page));
-                    DEBUGF("! rtu->p=%p\n", rtu->p);
-                    rtu->p->next = p;
-                    p->prev = rtu->p;
-                    p = rtu->p;
-                    goto new_head_page;
-                }
-                p = p->prev;
-                break;
+    pdu = (rtu->type == TCP) ? buf + 7 : buf + 1;
+    pdu_len = len - (rtu->type == TCP ? 7 : 3);
+    ttd = clock_msec() + rtu->conf->ttl;
+
+    if (func >= 1 && func <= 4) {
+        /* Keep read values in the register image, any sub-range is served from it */
+        if (pdu_len >= 2 && !(pdu[0] & 0x80) &&
+            reg_image_update(&rtu->image[slave], func,
+                             q->span_nb ? q->span_addr : addr, q->span_nb ? q->span_nb : nb,
+                             pdu + 2, pdu_len - 2, ttd) == 0) {
+            uint8_t ans[BUF_SIZE];
+
+            /* Own range of the query, the image may be invalidated by writes before it's sent */
+            i = reg_image_read(rtu->image[slave], func, addr, nb, 0, ans + 2, sizeof(ans) - 2);
+            if (i >= 0) {
+                ans[0] = func;
+                ans[1] = i;
+                mbuf_put(q->answer);
+                q->answer = mbuf_new(ans, i + 2);
             }
-            p = p->next;
+            q->answered = 1;
+            return;
         }
-        new = calloc(1, sizeof(struct cache_page));
-        DEBUGF("! new=%p\n", new);
-        new->next = p->next;
-        if (new->next)
-            new->next->prev = new;
-        p->next = new;
-        new->prev = p;
-        p = new;
-    }
-
-new_head_page:
-    p->function = func;
-    p->slaveid = slave;
-    p->addr = addr;
-    if (p->buf) {
-        if (p->len != len)
-            p->buf = realloc(p->buf, len);
-            DEBUGF("! p->buf+%p\n", p->buf);
+
+        /* Merged read may cover items missed on the slave, don't blame the query */
+        if (_queue_unmerge(rtu, q))
+            return;
     } else {
-        p->buf = calloc(1, len);
-        DEBUGF("! new p->buf=%p\n", p->buf);
+        /* Values may be changed by the write, its answer is never cached */
+        reg_image_invalidate(rtu->image[slave], func, addr, nb);
+        if (pdu_len >= 1) {
+            mbuf_put(q->answer);
+            q->answer = mbuf_new(pdu, pdu_len);
+        }
+        q->answered = 1;
+        return;
     }
-    p->len = len;
 
-update:
-    if (rtu->type == TCP) {
-        memcpy(p->buf, buf, len);
-    } else if (rtu->type == RTU) {
-        /* Remove CRC */
-        DEBUGF("=== UP %d <> %d\e[1;34m\n", p->len, len-2);
-        p->len -= 2;
-        memcpy(p->buf, buf, p->len);
-        dump(p->buf, p->len);
-        DEBUGF("\e[0m");
+    if (len > CACHE_PAGE_DATA || pdu_len < 1) {
+        printf("_cache_update: bad answer length=%zu #%d\n", len, rtu->fd);
+        return;
+    }
+
+    p = page_cache_insert(&rtu->cache, slave, func, addr, nb);
+    if (!p) {
+        printf("_cache_update: no memory for page #%d\n", rtu->fd);
+        return;
+    }
+    DEBUGF("=== update %p (%d,%d)\n", p, nb, pdu_len);
+
+    /* Answers still pending to clients keep the previous PDU */
+    mbuf_put(p->pdu);
+    p->pdu = mbuf_new(pdu, pdu_len);
+    if (!p->pdu) {
+        printf("_cache_update: no memory for answer #%d\n", rtu->fd);
+        timer_del(rtu->tw, &p->timer);
+        page_cache_remove(&rtu->cache, p);
+        return;
     }
     /* TODO: TTL have to be configured via config for each RTU / slave */
 //    q->stamp = 0;
-    p->ttd = time(NULL) + rtu->conf->ttl;
+    p->ttd = ttd;
+    p->timer.type = TIMER_PAGE;
+    p->timer.data = rtu;
+    timer_add(rtu->tw, &p->timer, p->ttd);
 
+    mbuf_put(q->answer);
+    q->answer = mbuf_get(p->pdu);
     q->answered = 1;
 }
 
+/* Forget the in-flight TCP transaction of the query */
+void _tid_release(struct rtu_desc *rtu, struct queue_list *q)
+{
+    struct queue_list **slot;
+
+    if (rtu->type != TCP)
+        return;
+
+    slot = &rtu->tid_map[((q->buf[0] << 8) | q->buf[1]) & TID_MAP_MASK];
+    if (*slot == q) {
+        *slot = NULL;
+        rtu->inflight--;
+    }
+}
+
+/* Take a free TID for the TCP transaction of the query */
+static void _tid_assign(struct rtu_desc *rtu, struct queue_list *q)
+{
+    /* Zero is not allowed as TID, TIDs of in-flight slots are skipped */
+    do {
+        rtu->tid++;
+    } while (!rtu->tid || rtu->tid_map[rtu->tid & TID_MAP_MASK]);
+
+    q->buf[0] = rtu->tid >> 8;
+    q->buf[1] = rtu->tid & 0xff;
+    rtu->tid_map[rtu->tid & TID_MAP_MASK] = q;
+    rtu->inflight++;
+}
+
 void cache_update(struct rtu_desc *rtu, const uint8_t *buf, size_t len)
 {
     int rc;
-    struct queue_list *q;
+    struct queue_list **qp;
 
     if (len < 5) {
         printf("cache_update: too short MBUS RTU=%d #%d\n", len, rtu->fd);
@@ -265,321 +314,1153 @@ void cache_update(struct rtu_desc *rtu, const uint8_t *buf, size_t len)
         return;
     }
 
-    if ((rc = pthread_rwlock_wrlock(&rwlock)) != 0) {
+    if ((rc = pthread_rwlock_wrlock(&rtu->lock)) != 0) {
         printf("cache_update: wrlock=%d\n", rc);
         return;
     }
 
+    if (rtu->type == TCP) {
+        /* Answers may come in any order, match them by TID */
+        struct queue_list *q = rtu->tid_map[((buf[0] << 8) | buf[1]) & TID_MAP_MASK];
+
+        if (q && q->requested && !q->answered &&
+            q->buf[0] == buf[0] && q->buf[1] == buf[1]) {
+            stat_answer(rtu->stat, q->src, clock_usec() - q->sent, len > 7 && (buf[7] & 0x80));
+            _cache_update(rtu, q, buf, len);
+            _tid_release(rtu, q);
+        } else {
+            DEBUGF(">>> Unexpected TID %d #%d\n", (buf[0] << 8) | buf[1], rtu->fd);
+        }
+        goto unlock;
+    }
+
     /* Find appropriate query page */
-    VFOREACH(rtu->q, q) {
+    VFOREACH(rtu->q, qp) {
+        struct queue_list *q = *qp;
+
         if (q->buf[0] != buf[0] || q->answered || !q->requested)
             continue;
 
+        stat_answer(rtu->stat, q->src, clock_usec() - q->sent, buf[1] & 0x80);
         _cache_update(rtu, q, buf, len);
         break;
     }
 
-    if (pthread_rwlock_unlock(&rwlock) != 0)
+unlock:
+    if (pthread_rwlock_unlock(&rtu->lock) != 0)
         printf("cache_update: unlock FAILED\n");
 }
 
-inline struct cache_page *_page_free(struct rtu_desc *rtu, struct cache_page *p)
+inline void _page_free(struct rtu_desc *rtu, struct cache_page *p)
 {
-    struct cache_page *next;
-
     if (!rtu || !p)
+        return;
+
+    DEBUGF("_page_free: p=%p\n", p);
+    timer_del(rtu->tw, &p->timer);
+    page_cache_remove(&rtu->cache, p);
+}
+
+static inline struct conn *conn_by_fd(struct cfg *cfg, int fd)
+{
+    if (fd < 0 || fd >= cfg->maxconns)
         return NULL;
 
-    DEBUGF("_page_free: p->buf=%p\n", p->buf);
-    free(p->buf);
-    if (!p->prev) {
-        rtu->p = p->next;
-        if (rtu->p)
-            rtu->p->prev = NULL;
-    } else {
-        p->prev->next = p->next;
-        if (p->next)
-            p->next->prev = p->prev;
-    }
-    next = p->next;
-    DEBUGF("free p=%p\n", p);
-    free(p);
-    DEBUGF("-- ok\n");
+    return &cfg->conns[fd];
+}
 
-    return next;
+/* Generation of the connection, valid for the serving tcp_thread only */
+static inline uint32_t conn_gen(struct cfg *cfg, int fd)
+{
+    struct conn *c = conn_by_fd(cfg, fd);
+
+    return c ? c->gen : 0;
 }
 
-struct cache_page *_cache_find(struct rtu_desc *rtu, struct queue_list *q)
+/* MBAP header of the answer with `len' bytes of PDU to the client */
+static inline void mbap_header(uint8_t *hdr, const uint8_t *tido, int src, int len)
+{
+    hdr[0] = tido[0];
+    hdr[1] = tido[1];
+    hdr[2] = hdr[3] = 0;
+    hdr[4] = ((len + 1) >> 8) & 0xff;
+    hdr[5] = (len + 1) & 0xff;
+    hdr[6] = src;
+}
+
+/*
+ * Find the answer PDU in the register image or the cache page.
+ * Items expired by `now' are not used, zero `now' takes any cached data.
+ * Image data is built in `pdu', the PDU of the page is returned in `shared'
+ * without a reference, so RTU has to stay locked while it's used.
+ * Returns PDU length, 0 if nothing is cached or -1 if it doesn't fit.
+ */
+int _cache_answer(struct rtu_desc *rtu, int slave, int func, int addr, int nb,
+                  uint64_t now, uint8_t *pdu, size_t size, struct mbuf **shared)
 {
-    int slave = 0;
-    int addr = 0;
-    int func = 0;
-    int nb = 0;
     struct cache_page *p;
+    int len;
 
-    if (!rtu)
-        return NULL;
+    *shared = NULL;
+    if (size < 2)
+        return -1;
 
-    /* TODO: Write (change register) request shouldn't be cached */
+    len = reg_image_read(rtu->image[slave], func, addr, nb, now, pdu + 2, size - 2);
+    if (len >= 0) {
+        pdu[0] = func;
+        pdu[1] = len;
+        return len + 2;
+    }
 
-    p = rtu->p;
-    if (rtu->type == TCP) {
-        slave = q->buf[6];
-        func = q->buf[7];
-        addr = (q->buf[8] << 8) | q->buf[9];
-        nb = (q->buf[10] << 8) | q->buf[11];
-    } else if (rtu->type == RTU) {
-        slave = q->buf[0];
-        func = q->buf[1];
-        addr = (q->buf[2] << 8) | q->buf[3];
-        nb = (q->buf[4] << 8) | q->buf[5];
-    }
-
-//    DEBUGF("search for sid=%d addr=%d nb=%d\n", slave, addr, nb);
-
-    while (p) {
-//        DEBUGF("--> (%d,%d,%d+%d) <> (%d,%d,%d+%d)\n",
-//               slave, func, addr, nb, p->slaveid, p->function, p->addr, p->len);
-        if (slave < p->slaveid)
-            return NULL;
-        if (func == p->function && slave == p->slaveid && addr == p->addr)
-            return p;
-        p = p->next;
-    }
-
-    return p;
+    p = page_cache_lookup(&rtu->cache, slave, func, addr, nb);
+    if (!p || !p->pdu || (now && p->ttd <= now))
+        return 0;
+
+    *shared = p->pdu;
+    return p->pdu->len;
 }
 
-int queue_add(struct cfg *cfg,
-              int slave_id, int fd, const uint8_t *buf, size_t len)
+/* Answer for the queued query if it's cached */
+int _cache_query(struct rtu_desc *rtu, struct queue_list *q, uint8_t *pdu, size_t size,
+                 struct mbuf **shared)
 {
-    struct slave_map *mi;
-    struct rtu_desc *ri;
-    struct queue_list q;
-    struct queue_list *qp;
-    int already_in_queue = 0;
-    int rc;
+    int slave, func, addr, nb;
 
-    if ((rc = pthread_rwlock_wrlock(&rwlock)) != 0) {
-        printf("queue_add: wrlock=%d\n", rc);
-        return -1;
+    /* Answer received for the query itself */
+    if (q->answer) {
+        *shared = q->answer;
+        return q->answer->len;
     }
 
-    VFOREACH(cfg->rtu_list, ri) {
-        VFOREACH(ri->slave_id, mi) {
-            if (mi->src == slave_id)
-                goto found;
-        }
-    }
+    _query_tuple(rtu, q, &slave, &func, &addr, &nb);
+    if (func < 1 || func > 4)
+        return 0;
 
-    if (pthread_rwlock_unlock(&rwlock) != 0)
-        printf("queue_add: 0 unlock FAILED\n");
-    return -2;
+    /* Answer to the requested query is taken even if it's already expired */
+    return _cache_answer(rtu, slave, func, addr, nb,
+                         q->answered ? 0 : clock_msec(), pdu, size, shared);
+}
 
-found:
-    VFOREACH(ri->q, qp) {
-        if (qp->src == mi->src && qp->len == len-4 && !memcmp(qp->buf+1, buf+7, len-7)) {
-            already_in_queue = 1;
-            break;
-        }
-    }
+/*
+ * Answer to the client directly from the cache, avoiding RTU queue.
+ * RTU has to be locked for reading.
+ * Returns 1 if the answer is sent, 0 if the query has to be queued.
+ */
+static int _cache_reply(struct cfg *cfg, struct route *rt, int fd, uint32_t gen,
+                        const uint8_t *buf, size_t len)
+{
+    uint8_t hdr[7];
+    uint8_t pdu[BUF_SIZE];
+    struct mbuf *m;
+    int addr;
+    int nb;
+    int rc;
 
-    DEBUGF("Adding sid=%d to queue (%d@%d) len=%d fn=%d fd=#%d\n", slave_id, VLEN(ri->q), ri->fd, len, buf[7], fd);
+    /* Only read requests are served from the cache */
+    if (len != 12 || buf[7] < 1 || buf[7] > 4)
+        return 0;
 
-    if (VLEN(ri->q) >= 150 || already_in_queue) {
-        // build response with TIMEOUT error message
-        uint8_t errbuf[] = { 0x00, 0x01, 0x00, 0x00, 0x00, 0x03, 0x01, 0x83, 0x05 };
+    addr = (buf[8] << 8) | buf[9];
+    nb = (buf[10] << 8) | buf[11];
+    rc = _cache_answer(rt->rtu, rt->dst, buf[7], addr, nb, clock_msec(), pdu, sizeof(pdu), &m);
+    if (rc <= 0)
+        return 0;
 
-        errbuf[0] = buf[0];
-        errbuf[1] = buf[1];
-        errbuf[6] = buf[6];
-        errbuf[7] = buf[7] | 0x80;
+    DEBUGF("Cache hit sid=%d addr=%d, respond to #%d len=%d\n", buf[6], addr, fd, rc);
+    mbap_header(hdr, buf, buf[6], rc);
+    wbqueue_addv(cfg, fd, gen, hdr, sizeof(hdr), m ? m->data : pdu, rc);
 
-        if (already_in_queue) {
-            /* Query already in queue */
-            errbuf[8] = 0x05;
-            DEBUGF("...already in queue\n");
-        } else {
-            /* Slave is busy */
-            errbuf[8] = 0x06;
-            DEBUGF("...queue limit reached\n");
-        }
+    return 1;
+}
 
-        _wbqueue_add(cfg, fd, errbuf, sizeof(errbuf));
-        goto unlock;
+/* Wake up rtu_threads of the `mask' to process new queries */
+static void rtu_wakeup(struct cfg *cfg, uint64_t mask)
+{
+#ifndef _NUTTX_BUILD
+    uint64_t v = 1;
+    int n;
+
+    for (n = 0; mask; ++n, mask >>= 1) {
+        if (!(mask & 1))
+            continue;
+        if (write(cfg->sched[n].evfd, &v, sizeof(v)) < 0 && errno != EAGAIN)
+            perror("rtu_wakeup: write() failed");
     }
+#endif
+}
+
+/* Build MODBUS-TCP exception answer, returns its length */
+static int mbap_error(uint8_t *errbuf, const uint8_t *tido, int src, int function, int code)
+{
+    errbuf[0] = tido[0];
+    errbuf[1] = tido[1];
+    errbuf[2] = errbuf[3] = errbuf[4] = 0;
+    errbuf[5] = 3;
+    errbuf[6] = src;
+    errbuf[7] = function | 0x80;
+    errbuf[8] = code;
+
+    return 9;
+}
+
+/* Answer with the exception to the request of the client */
+static void queue_error(struct cfg *cfg, int fd, uint32_t gen,
+                        const uint8_t *tido, int src, int function, int code)
+{
+    uint8_t errbuf[9];
+
+    wbqueue_add(cfg, fd, gen, errbuf, mbap_error(errbuf, tido, src, function, code));
+}
+
+/* Build the query of the request for the RTU */
+static struct queue_list *_queue_new(struct cfg *cfg, struct route *rt, int fd, uint32_t gen,
+                                     const uint8_t *buf, size_t len)
+{
+    struct rtu_desc *ri = rt->rtu;
+    struct queue_list *q;
+    int slave_id = buf[6];
 
-    /* TODO: use gettimeofday() */
-    q.stamp = 0;
-    q.answered = 0;
-    q.requested = 0;
-    q.expire = time(NULL) + 240.0;
-    /* /TODO */
+    DEBUGF("Adding sid=%d to queue (@%d) len=%d fn=%d fd=#%d\n", slave_id, ri->fd, len, buf[7], fd);
 
-    q.resp_fd = fd;
+    /* Timer is armed by rtu_thread, request buffer follows the query */
+    q = pool_zalloc(sizeof(struct queue_list) + len);
+    if (!q)
+        return NULL;
+    q->stamp = 0;
+    q->answered = 0;
+    q->requested = 0;
+    q->expire = clock_msec() + QUERY_EXPIRE;
+
+    q->resp_fd = fd;
+    q->resp_gen = gen;
+    q->resp_worker = conn_by_fd(cfg, fd)->worker;
     DEBUGF("=== orig === %d\e[1;33m\n", fd);
     dump(buf, len);
     DEBUGF("\e[0m=== added === %d\n", fd);
     if (ri->type == RTU) {
         uint16_t crc;
-        q.len = len-4;
-        q.buf = calloc(1, q.len);
-        DEBUGF("! q.buf=%p (%d)\n", q.buf, q.len);
-        q.tido[0] = buf[0];
-        q.tido[1] = buf[1];
-        q.function = buf[7];
-        memcpy(q.buf, buf+6, len-6);
-        q.buf[0] = mi->dst;
-        q.src = mi->src;
-        crc = crc16(q.buf, q.len-2);
-        memcpy(q.buf+q.len-2, &crc, 2);
-        dump(q.buf, q.len);
+        q->len = len-4;
+        q->buf = (uint8_t *)(q + 1);
+        DEBUGF("! q->buf=%p (%d)\n", q->buf, q->len);
+        q->tido[0] = buf[0];
+        q->tido[1] = buf[1];
+        q->function = buf[7];
+        memcpy(q->buf, buf+6, len-6);
+        q->buf[0] = rt->dst;
+        q->src = slave_id;
+        crc = crc16(q->buf, q->len-2);
+        memcpy(q->buf+q->len-2, &crc, 2);
+        dump(q->buf, q->len);
     } else {
-        q.buf = calloc(1, len);
-        q.len = len;
-        q.src = mi->src;
-        memcpy(q.buf, buf, len);
+        q->buf = (uint8_t *)(q + 1);
+        q->len = len;
+        q->tido[0] = buf[0];
+        q->tido[1] = buf[1];
+        q->function = buf[7];
+        q->src = slave_id;
+        memcpy(q->buf, buf, len);
         /* Fixup destination slave address */
-        q.buf[6] = mi->dst;
+        q->buf[6] = rt->dst;
     }
 
-    VADD(ri->q, q);
+    return q;
+}
 
-unlock:
-    if (pthread_rwlock_unlock(&rwlock) != 0)
-        printf("queue_add: 0 unlock FAILED\n");
+/*
+ * Process requests parsed from one read of the client. Cache hits are
+ * answered under the read lock taken once per RTU, the rest is submitted
+ * to the RTU rings and every involved rtu_thread is woken once.
+ */
+void queue_batch(struct cfg *cfg, int fd, struct mbap_req *req, int n)
+{
+    uint32_t gen = conn_gen(cfg, fd);
+    struct stat_worker *st = cfg->wk[conn_by_fd(cfg, fd)->worker].stat;
+    uint64_t queued = 0;
+    int misses;
+    int rc;
+    int i, j;
+
+    for (i = 0; i < n; ++i) {
+        req[i].rt = cfg_route(cfg, req[i].buf[6]);
+        req[i].rtu = req[i].rt ? req[i].rt->rtu : NULL;
+        stat_add(&st->requests[req[i].buf[6]], 1);
+    }
+
+    for (i = 0; i < n; ++i) {
+        struct rtu_desc *ri = req[i].rtu;
+
+        if (!ri)
+            continue;
+
+        if ((rc = pthread_rwlock_rdlock(&ri->lock)) != 0) {
+            printf("queue_batch: rdlock=%d\n", rc);
+            goto drop;
+        }
+        misses = 0;
+        for (j = i; j < n; ++j) {
+            if (req[j].rtu != ri)
+                continue;
+            if (_cache_reply(cfg, req[j].rt, fd, gen, req[j].buf, req[j].len)) {
+                req[j].rtu = NULL;
+                stat_add(&st->hits[req[j].buf[6]], 1);
+            } else
+                misses++;
+        }
+        if (pthread_rwlock_unlock(&ri->lock) != 0)
+            printf("queue_batch: unlock FAILED\n");
+
+        if (!misses)
+            continue;
+
+        for (j = i; j < n; ++j) {
+            struct queue_list *q;
+
+            if (req[j].rtu != ri)
+                continue;
+            req[j].rtu = NULL;
+
+            q = _queue_new(cfg, req[j].rt, fd, gen, req[j].buf, req[j].len);
+            if (q && ring_push(&ri->sq, q) == 0) {
+                queued |= 1ULL << ri->sched->n;
+                continue;
+            }
+
+            /* Slave is busy */
+            DEBUGF("...submit ring is full\n");
+            stat_add(&st->busy, 1);
+            pool_free(q);
+            queue_error(cfg, fd, gen, req[j].buf, req[j].buf[6], req[j].buf[7], 0x06);
+        }
+        continue;
+
+drop:
+        for (j = i; j < n; ++j) {
+            if (req[j].rtu == ri)
+                req[j].rtu = NULL;
+        }
+    }
+
+    if (queued)
+        rtu_wakeup(cfg, queued);
+}
+
+int conn_init(struct cfg *cfg)
+{
+    int n;
+#ifndef _NUTTX_BUILD
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+        cfg->maxconns = MIN(rl.rlim_cur, MAX_CONNS);
+    else
+#endif
+        cfg->maxconns = MAX_CONNS;
+
+    cfg->conns = calloc(cfg->maxconns, sizeof(struct conn));
+    if (!cfg->conns)
+        return -1;
+
+    for (n = 0; n < cfg->maxconns; ++n) {
+        pthread_mutex_init(&cfg->conns[n].lock, NULL);
+        cfg->conns[n].ep = -1;
+    }
 
     return 0;
 }
 
-void _wbqueue_add(struct cfg *cfg, int fd, uint8_t *buf, int len)
+/* Watch EPOLLOUT of the client only while answers are pending */
+static void conn_arm(struct conn *c, int fd, int out)
 {
-    struct writeback wb;
+    struct epoll_event ev;
 
-    if (fd < 0)
+    if (c->armed == out || c->ep < 0)
         return;
 
-    wb.fd = fd;
-    wb.len = len;
-    wb.buf = calloc(1, len);
-    memcpy(wb.buf, buf, len);
+    ev.events = EPOLLIN | (out ? EPOLLOUT : 0);
+    ev.data.fd = fd;
+    if (epoll_ctl(c->ep, EPOLL_CTL_MOD, fd, &ev) < 0)
+        perror("conn_arm: epoll_ctl MOD()");
+    c->armed = out;
+}
+
+/* Append bytes to the outbound ring, growing it up to CONN_OBUF_MAX */
+static int _conn_push(struct conn *c, const uint8_t *buf, uint32_t len)
+{
+    uint32_t tail;
+    uint32_t first;
+
+    if (c->olen + len > c->osize) {
+        uint32_t size = c->osize ? c->osize : CONN_OBUF_MIN;
+        uint8_t *nbuf;
+
+        while (size < c->olen + len)
+            size *= 2;
+        if (size > CONN_OBUF_MAX || !(nbuf = malloc(size)))
+            return -1;
+
+        /* Move pending bytes to the start of the new ring */
+        if (c->olen) {
+            first = MIN(c->olen, c->osize - c->ohead);
+            memcpy(nbuf, c->obuf + c->ohead, first);
+            memcpy(nbuf + first, c->obuf, c->olen - first);
+        }
+        free(c->obuf);
+        c->obuf = nbuf;
+        c->osize = size;
+        c->ohead = 0;
+    }
+
+    tail = (c->ohead + c->olen) & (c->osize - 1);
+    first = MIN(len, c->osize - tail);
+    memcpy(c->obuf + tail, buf, first);
+    memcpy(c->obuf, buf + first, len - first);
+    c->olen += len;
 
-    VADD(cfg->wbq, wb);
-    DEBUGF(">>> queue(%d) to %d ! wb.buf=%p buf=%p len=%d\n", VLEN(cfg->wbq), fd, wb.buf, buf, len);
+    return 0;
 }
 
-void wbqueue_free(struct cfg *cfg, int fd)
+/* Write pending bytes until the socket is full, returns -1 on error */
+static int _conn_flush(struct conn *c, int fd)
 {
-    int i;
+    struct iovec iov[2];
+    uint32_t first;
+    ssize_t nw;
+    int cnt;
+
+    while (c->olen) {
+        first = MIN(c->olen, c->osize - c->ohead);
+        iov[0].iov_base = c->obuf + c->ohead;
+        iov[0].iov_len = first;
+        cnt = 1;
+        if (first < c->olen) {
+            iov[1].iov_base = c->obuf;
+            iov[1].iov_len = c->olen - first;
+            cnt = 2;
+        }
+
+        nw = writev(fd, iov, cnt);
+        if (nw < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        c->ohead = (c->ohead + nw) & (c->osize - 1);
+        c->olen -= nw;
+    }
+    c->ohead = 0;
+
+    return 0;
+}
+
+/*
+ * Send the answer to the client of `gen' generation: its own header
+ * and the body, which may be shared with the cache.
+ * The answer is written at once if nothing is pending, the rest
+ * is kept in the outbound ring and flushed on EPOLLOUT.
+ */
+void wbqueue_addv(struct cfg *cfg, int fd, uint32_t gen, const uint8_t *hdr, int hlen,
+                  const uint8_t *body, int blen)
+{
+    struct conn *c;
+    ssize_t nw;
     int rc;
 
-    /* TODO: dealloc queues by fd, destroy answer queue */
-    if ((rc = pthread_rwlock_wrlock(&rwlock)) != 0) {
-        printf("wbqueue_free: wrlock=%d\n", rc);
+    if (!(c = conn_by_fd(cfg, fd)))
+        return;
+
+    if ((rc = pthread_mutex_lock(&c->lock)) != 0) {
+        printf("wbqueue_add: lock=%d\n", rc);
         return;
     }
 
-    VFORI(cfg->wbq, i) {
-        struct writeback *q = &VGET(cfg->wbq, i);
-        if (q->fd != fd)
-            continue;
+    if (c->gen != gen) {
+        DEBUGF(">>> drop answer to the closed connection #%d\n", fd);
+        goto unlock;
+    }
+
+    if (!c->olen) {
+        struct iovec iov[2];
+
+        iov[0].iov_base = (void *)hdr;
+        iov[0].iov_len = hlen;
+        iov[1].iov_base = (void *)body;
+        iov[1].iov_len = blen;
+        nw = writev(fd, iov, blen ? 2 : 1);
+        if (nw < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                goto unlock;
+            nw = 0;
+        }
+        if (nw >= hlen) {
+            body += nw - hlen;
+            blen -= nw - hlen;
+            hlen = 0;
+        } else {
+            hdr += nw;
+            hlen -= nw;
+        }
+    }
 
-        DEBUGF("wbqueue_free: q->buf=%p\n", q->buf);
-        free(q->buf);
-        q->buf = NULL;
-        q->fd = -1;
-//        VREMOVE(cfg->wbq, i);
-        VDELETE_ORDER(cfg->wbq, i);
-        --i;
+    if (hlen + blen > 0) {
+        if (_conn_push(c, hdr, hlen) < 0 || _conn_push(c, body, blen) < 0) {
+            /* Client doesn't read answers, drop it */
+            printf("wbqueue_add: #%d outbound overflow (%u pending)\n", fd, c->olen);
+            shutdown(fd, SHUT_RDWR);
+            goto unlock;
+        }
+        conn_arm(c, fd, 1);
+    }
+    DEBUGF(">>> queue(%u) to %d len=%d\n", c->olen, fd, hlen + blen);
+
+unlock:
+    if (pthread_mutex_unlock(&c->lock) != 0)
+        printf("wbqueue_add: unlock FAILED\n");
+}
+
+void wbqueue_add(struct cfg *cfg, int fd, uint32_t gen, const uint8_t *buf, int len)
+{
+    wbqueue_addv(cfg, fd, gen, buf, len, NULL, 0);
+}
+
+void wbqueue_free(struct cfg *cfg, int fd)
+{
+    struct conn *c;
+    int rc;
+
+    if (!(c = conn_by_fd(cfg, fd)))
+        goto out;
+
+    if ((rc = pthread_mutex_lock(&c->lock)) != 0) {
+        printf("wbqueue_free: lock=%d\n", rc);
+        goto out;
     }
 
-    if (pthread_rwlock_unlock(&rwlock) != 0)
+    /* Answers to the queries of this client are not for the next one */
+    c->gen++;
+    free(c->obuf);
+    c->obuf = NULL;
+    c->osize = c->ohead = c->olen = 0;
+    c->armed = 0;
+    c->ep = -1;
+    free(c->ibuf);
+    c->ibuf = NULL;
+    c->ilen = 0;
+
+    if (pthread_mutex_unlock(&c->lock) != 0)
         printf("wbqueue_free: 0 unlock FAILED\n");
 
+out:
     close(fd);
 }
 
 void wbqueue_write(struct cfg *cfg, int fd)
 {
-    int i;
+    struct conn *c;
     int rc;
 
-    if ((rc = pthread_rwlock_wrlock(&rwlock)) != 0) {
-        printf("wbqueue_write: wrlock=%d\n", rc);
+    if (!(c = conn_by_fd(cfg, fd)))
         return;
-    }
-
-    VFORI(cfg->wbq, i) {
-        struct writeback *q = &VGET(cfg->wbq, i);
-        if (q->fd != fd)
-            continue;
 
-        DEBUGF("\e[1;32m<<< write to #%d buf=%p len=%d\n", fd, q->buf, q->len);
-        write(fd, q->buf, q->len);
-        dump(q->buf, q->len);
+    if ((rc = pthread_mutex_lock(&c->lock)) != 0) {
+        printf("wbqueue_write: lock=%d\n", rc);
+        return;
+    }
 
-        DEBUGF("\e[0mwbqueue_write: q->buf=%p\n", q->buf);
-        free(q->buf);
-        q->buf = NULL;
-        q->fd = -1;
-//        VREMOVE(cfg->wbq, i);
-        VDELETE_ORDER(cfg->wbq, i);
-        --i;
+    DEBUGF("<<< write to #%d len=%u\n", fd, c->olen);
+    if (_conn_flush(c, fd) < 0) {
+        /* Connection is broken, EPOLLHUP/EPOLLERR closes it */
+        c->olen = 0;
     }
+    if (!c->olen)
+        conn_arm(c, fd, 0);
 
-    if (pthread_rwlock_unlock(&rwlock) != 0)
+    if (pthread_mutex_unlock(&c->lock) != 0)
         printf("wbqueue_write: 0 unlock FAILED\n");
 }
 
-inline void _queue_remove(struct rtu_desc *rtu, int n)
+/* Wake up tcp_threads having answers posted by the rtu_thread */
+static void resp_wakeup(struct rtu_sched *s)
 {
-    struct queue_list *q;
+    int n;
 
-    if (!rtu)
-        return;
+    for (n = 0; n < s->cfg->workers; ++n) {
+        if (!s->wake[n])
+            continue;
+        s->wake[n] = 0;
+#ifndef _NUTTX_BUILD
+        {
+            uint64_t v = 1;
 
-    q = &VGET(rtu->q, n);
-    DEBUGF("_queue_remove: q->buf=%p l=%d\n", q->buf, q->len);
-    free(q->buf);
-    q->buf = NULL;
-//    VREMOVE(rtu->q, n);
-    VDELETE_ORDER(rtu->q, n);
-    DEBUGF("-- ok\n");
+            if (write(s->cfg->wk[n].evfd, &v, sizeof(v)) < 0 && errno != EAGAIN)
+                perror("resp_wakeup: write() failed");
+        }
+#endif
+    }
 }
 
-void *rtu_thread(void *arg)
+/*
+ * Post the answer to the query from rtu_thread, it's sent by
+ * the tcp_thread serving the client. The thread is woken
+ * by resp_wakeup() once all answers of the pass are posted.
+ * RTU may be locked here, so the answer is held by rtu_thread
+ * if the ring is full, resp_flush() pushes it later.
+ */
+static void resp_post(struct rtu_desc *ri, const struct queue_list *q, struct mbuf *pdu)
 {
-    int ep;
-    int rc;
-    struct rtu_desc *ri;
-    struct cache_page *p;
-    queue_list_v *qv;
-    struct queue_list *q;
-    struct epoll_event *evs;
-    struct cfg *cfg = (struct cfg *)arg;
+    struct cfg *cfg = ri->conf;
+    struct rtu_sched *s = ri->sched;
+    struct workers *w;
+    struct resp *r;
 
-    ep = epoll_create(VLEN(cfg->rtu_list));
-    if (ep == -1) {
-        perror("epoll_create() failed");
-        return NULL;
-    }
+    if (!pdu || q->resp_fd < 0 || q->resp_worker < 0 || q->resp_worker >= cfg->workers)
+        return;
+    w = &cfg->wk[q->resp_worker];
 
-    evs = malloc(sizeof(struct epoll_event) * VLEN(cfg->rtu_list));
+    r = pool_alloc(sizeof(struct resp));
+    if (!r) {
+        printf("resp_post: no memory for answer\n");
+        return;
+    }
+    r->fd = q->resp_fd;
+    r->gen = q->resp_gen;
+    mbap_header(r->hdr, q->tido, q->src, pdu->len);
+    r->pdu = mbuf_get(pdu);
+    r->next = NULL;
+
+    /* Answers held already go first */
+    if (s->held[w->n] || ring_push(&w->rq, r) < 0) {
+        if (s->held[w->n])
+            s->held_tail[w->n]->next = r;
+        else
+            s->held[w->n] = r;
+        s->held_tail[w->n] = r;
+    }
+    s->wake[w->n] = 1;
+}
+
+/*
+ * Push the held answers to the rings, called by rtu_thread with
+ * no RTU locked. Returns non-zero if some are still held.
+ */
+static int resp_flush(struct rtu_sched *s)
+{
+    struct resp *r;
+    int held = 0;
+    int n;
+
+    for (n = 0; n < s->cfg->workers; ++n) {
+        while ((r = s->held[n])) {
+            if (ring_push(&s->cfg->wk[n].rq, r) < 0) {
+                held = 1;
+                break;
+            }
+            s->held[n] = r->next;
+        }
+    }
+
+    return held;
+}
+
+/* Send answers posted by rtu_thread, called by the tcp_thread */
+static void resp_drain(struct workers *self)
+{
+    struct resp *r;
+
+    while ((r = ring_pop(&self->rq))) {
+        wbqueue_addv(self->cfg, r->fd, r->gen, r->hdr, sizeof(r->hdr),
+                     r->pdu->data, r->pdu->len);
+        mbuf_put(r->pdu);
+        pool_free(r);
+    }
+}
+
+static inline void _queue_remove(struct rtu_desc *rtu, int n)
+{
+    struct queue_list *q;
+    struct queue_list **mp;
+
+    if (!rtu)
+        return;
+
+    q = VGET(rtu->q, n);
+    DEBUGF("_queue_remove: q=%p l=%d\n", q, q->len);
+    timer_del(rtu->tw, &q->timer);
+    _tid_release(rtu, q);
+    /* Queries covered by the read or waiting for it are on their own now */
+    VFOREACH(rtu->q, mp) {
+        if ((*mp)->lead == q)
+            (*mp)->lead = NULL;
+    }
+    mbuf_put(q->answer);
+    pool_free(q);
+//    VREMOVE(rtu->q, n);
+    VDELETE_ORDER(rtu->q, n);
+    DEBUGF("-- ok\n");
+}
+
+/*
+ * Send the answer to the n-th query to all queries waiting for the same
+ * read, with their own TID and slave id. Waiters are queued after the
+ * query they wait for, so queries up to n-th stay in place.
+ * Non-zero `hit' counts the answers as taken from the cache.
+ */
+static void _queue_fanout(struct cfg *cfg, struct rtu_desc *ri, int n, struct mbuf *pdu, int hit)
+{
+    struct queue_list *q = VGET(ri->q, n);
+    int j;
+
+    for (j = VLEN(ri->q) - 1; j > n; --j) {
+        struct queue_list *w = VGET(ri->q, j);
+
+        if (w->lead != q || !_queue_same(ri, w, q))
+            continue;
+
+        DEBUGF("fan-out %p to #%d\n", q, w->resp_fd);
+        if (hit)
+            stat_add(&stat_slave(ri->stat, w->src)->hits, 1);
+        resp_post(ri, w, pdu);
+        _queue_remove(ri, j);
+    }
+}
+
+/*
+ * Extend the read of the query to pending reads of the same slave and
+ * function lying within `merge_gap' items, while the read fits the
+ * MODBUS limits. Returns number of merged queries.
+ */
+static int _queue_merge(struct rtu_desc *ri, struct queue_list *q)
+{
+    struct queue_list **mp;
+    int slave, func, addr, nb;
+    int s, f, a, c;
+    int lo, hi, limit;
+    int merged = 0;
+    int more;
+
+    _query_tuple(ri, q, &slave, &func, &addr, &nb);
+    q->span_addr = addr;
+    q->span_nb = nb;
+
+    if (func < 1 || func > 4 || ri->merge_gap < 0 || q->nomerge)
+        return 0;
+
+    limit = func <= 2 ? MAX_READ_BITS : MAX_READ_REGS;
+    if (nb <= 0 || nb > limit)
+        return 0;
+
+    lo = addr;
+    hi = addr + nb;
+    do {
+        more = 0;
+        VFOREACH(ri->q, mp) {
+            struct queue_list *m = *mp;
+
+            if (m == q || m->lead || m->stamp || m->nomerge)
+                continue;
+
+            _query_tuple(ri, m, &s, &f, &a, &c);
+            if (s != slave || f != func || c <= 0)
+                continue;
+            if (a > hi + ri->merge_gap || a + c + ri->merge_gap < lo)
+                continue;
+            if (MAX(hi, a + c) - MIN(lo, a) > limit)
+                continue;
+
+            lo = MIN(lo, a);
+            hi = MAX(hi, a + c);
+            m->lead = q;
+            merged++;
+            more = 1;
+        }
+    } while (more);
+
+    if (merged) {
+        DEBUGF("merged %d reads: sid=%d fn=%d %d+%d\n", merged, slave, func, lo, hi - lo);
+        q->span_addr = lo;
+        q->span_nb = hi - lo;
+    }
+
+    return merged;
+}
+
+/* Build upstream request of the query, possibly merged with other reads */
+static int _queue_request(struct rtu_desc *ri, struct queue_list *q, uint8_t *req, size_t size)
+{
+    uint8_t *pdu;
+    uint16_t crc;
+
+    if (q->len > size)
+        return -1;
+
+    memcpy(req, q->buf, q->len);
+    if (!_queue_merge(ri, q))
+        return q->len;
+
+    pdu = (ri->type == TCP) ? req + 6 : req;
+    pdu[2] = q->span_addr >> 8;
+    pdu[3] = q->span_addr & 0xff;
+    pdu[4] = q->span_nb >> 8;
+    pdu[5] = q->span_nb & 0xff;
+    if (ri->type == RTU) {
+        crc = crc16(req, q->len - 2);
+        memcpy(req + q->len - 2, &crc, 2);
+    }
+
+    return q->len;
+}
+
+/* Take queries submitted by tcp_threads to the RTU queue */
+static void rtu_submit(struct cfg *cfg, struct rtu_desc *ri)
+{
+    struct queue_list *q;
+    struct queue_list **qp;
+
+    while ((q = ring_pop(&ri->sq))) {
+        /* The same read is pending, wait for its answer */
+        VFOREACH(ri->q, qp) {
+            if (_queue_same(ri, *qp, q)) {
+                q->lead = (*qp)->lead ? (*qp)->lead : *qp;
+                DEBUGF("...wait for %p\n", q->lead);
+                break;
+            }
+        }
+
+        if (VLEN(ri->q) >= (q->lead ? MAX_QUEUE_WAIT : MAX_QUEUE)) {
+            uint8_t err[2] = { q->function | 0x80, 0x06 };
+            struct mbuf *m = mbuf_new(err, sizeof(err));
+
+            /* Slave is busy */
+            DEBUGF("...queue limit reached\n");
+            resp_post(ri, q, m);
+            mbuf_put(m);
+            pool_free(q);
+            continue;
+        }
+
+        VADD(ri->q, q);
+    }
+}
+
+/* Transactions in flight are lost with the TCP connection, repeat them */
+static void rtu_requeue(struct rtu_desc *ri)
+{
+    struct queue_list **qp;
+
+    if (ri->type != TCP)
+        return;
+
+    VFOREACH(ri->q, qp) {
+        struct queue_list *q = *qp;
+
+        q->lead = NULL;
+        if (!q->requested || q->answered)
+            continue;
+
+        _tid_release(ri, q);
+        q->requested = 0;
+        q->stamp = 0;
+        timer_add(ri->tw, &q->timer, q->expire);
+    }
+    ri->rxlen = 0;
+}
+
+/* Split MODBUS-TCP stream of the endpoint to answers */
+static int rtu_tcp_read(struct rtu_desc *ri)
+{
+    int len;
+    int flen;
+
+    len = read(ri->fd, ri->rxbuf + ri->rxlen, sizeof(ri->rxbuf) - ri->rxlen);
+    if (len <= 0)
+        return -1;
+    ri->rxlen += len;
+
+    while (ri->rxlen >= 8) {
+        flen = 6 + ((ri->rxbuf[4] << 8) | ri->rxbuf[5]);
+        if (flen < 8 || flen > MBAP_FRAME_MAX) {
+            printf("Broken MBAP header #%d, drop %d bytes\n", ri->fd, ri->rxlen);
+            dumpr(ri->rxbuf, ri->rxlen);
+            ri->rxlen = 0;
+            break;
+        }
+        if (ri->rxlen < flen)
+            break;
+
+        cache_update(ri, ri->rxbuf, flen);
+        ri->rxlen -= flen;
+        memmove(ri->rxbuf, ri->rxbuf + flen, ri->rxlen);
+    }
+
+    return 0;
+}
+
+/* Keep the earliest deadline to wake up rtu_thread at */
+static inline void deadline_min(uint64_t *next, uint64_t usec)
+{
+    if (!*next || usec < *next)
+        *next = usec;
+}
+
+#ifndef _NUTTX_BUILD
+/* Arm timer to the absolute deadline, zero deadline disarms the timer */
+static void deadline_arm(int tfd, uint64_t next)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = next / 1000000;
+    its.it_value.tv_nsec = (next % 1000000) * 1000;
+    if (timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+        perror("timerfd_settime() failed");
+}
+#endif
+
+/* Answer to the client with timeout error and drop the query */
+static void _queue_timeout(struct cfg *cfg, struct rtu_desc *ri, int n, uint64_t now)
+{
+    struct queue_list *q = VGET(ri->q, n);
+    struct mbuf *m;
+    int inflight = q->stamp != 0;
+    // build response with TIMEOUT error message
+    uint8_t errbuf[] = { 0x00, 0x01, 0x00, 0x00, 0x00, 0x03, 0x01, 0x83, 0x05, 0x00, 0x00 };
+
+    DEBUGF("Remove from queue(%d) #%d %p: sid=%d stamp=%llu,exp=%llu %llu\n", VLEN(ri->q), ri->fd, q, q->buf[0], q->stamp, q->expire, now);
+
+    errbuf[0] = q->tido[0];
+    errbuf[1] = q->tido[1];
+    errbuf[6] = q->src;
+    errbuf[7] = q->function | 0x80;
+
+    /* Slave is busy */
+    if (q->expire <= now)
+        errbuf[8] = 0x06;
+
+    if (inflight) {
+        stat_add(&ri->stat->timeouts, 1);
+        stat_add(&stat_slave(ri->stat, q->src)->timeouts, 1);
+    }
+
+    /* Reset `toread' buffer of the query on the line */
+    if (inflight && (ri->toreadbuf || ri->toread)) {
+        pool_free(ri->toreadbuf);
+        ri->toread = 0;
+        ri->toread_off = 0;
+        ri->toreadbuf = NULL;
+    }
+
+    /* Timeout isn't an answer of the slave, queries covered by the merged read are retried */
+    q->span_nb = 0;
+
+    /* Update cache with fective CRC */
+    _cache_update(ri, q, errbuf + 6, 5);
+
+    m = mbuf_new(errbuf + 7, 2);
+    resp_post(ri, q, m);
+    _queue_fanout(cfg, ri, n, m, 0);
+    mbuf_put(m);
+    _queue_remove(ri, n);
+}
+
+/* Answer the query and its waiters with the exception `code', nothing is cached */
+static void _queue_fail(struct cfg *cfg, struct rtu_desc *ri, int n, uint8_t code)
+{
+    struct queue_list *q = VGET(ri->q, n);
+    uint8_t err[2] = { q->function | 0x80, code };
+    int slave, func, addr, nb;
+    struct mbuf *m;
+
+    stat_add(&ri->stat->errors, 1);
+    stat_add(&stat_slave(ri->stat, q->src)->errors, 1);
+
+    _query_tuple(ri, q, &slave, &func, &addr, &nb);
+    /* Write may have been done anyway */
+    if (func < 1 || func > 4)
+        reg_image_invalidate(ri->image[slave], func, addr, nb);
+
+    m = mbuf_new(err, 2);
+    resp_post(ri, q, m);
+    _queue_fanout(cfg, ri, n, m, 0);
+    mbuf_put(m);
+    _queue_remove(ri, n);
+}
+
+/* Answer of the serial line is corrupt, fail the query in flight */
+static void rtu_frame_error(struct cfg *cfg, struct rtu_desc *ri, const uint8_t *buf, int len)
+{
+    int n;
+
+    printf("Corrupt frame (%d bytes) #%d\n", len, ri->fd);
+    dumpr(buf, len);
+
+    if (pthread_rwlock_wrlock(&ri->lock) != 0)
+        return;
+
+    VFORI(ri->q, n) {
+        struct queue_list *q = VGET(ri->q, n);
+
+        if (q->stamp && q->requested && !q->answered) {
+            /* Gateway target device failed to respond */
+            _queue_fail(cfg, ri, n, 0x0b);
+            break;
+        }
+    }
+
+    pthread_rwlock_unlock(&ri->lock);
+}
+
+/* Serial answer is complete or the line went silent */
+static void rtu_frame_done(struct cfg *cfg, struct rtu_desc *ri)
+{
+    uint8_t *buf = ri->toreadbuf;
+    int len = ri->toread_off;
+
+    ri->toread = 0;
+    ri->toread_off = 0;
+    ri->toreadbuf = NULL;
+
+    if (rtu_frame_check(buf, len))
+        cache_update(ri, buf, len);
+    else
+        rtu_frame_error(cfg, ri, buf, len);
+    pool_free(buf);
+}
+
+/* Expired timer of the query or the cache page */
+static void rtu_timer(struct timer *t, void *arg)
+{
+    struct cfg *cfg = (struct cfg *)arg;
+    struct rtu_desc *ri = t->data;
+    struct queue_list *q;
+    int rc;
+    int n;
+
+    if ((rc = pthread_rwlock_wrlock(&ri->lock)) != 0) {
+        printf("rtu_timer: wrlock=%d\n", rc);
+        return;
+    }
+
+    switch (t->type) {
+    case TIMER_PAGE:
+        _page_free(ri, container_of(t, struct cache_page, timer));
+        break;
+
+    case TIMER_QUERY:
+        q = container_of(t, struct queue_list, timer);
+        VFORI(ri->q, n) {
+            if (VGET(ri->q, n) == q) {
+                _queue_timeout(cfg, ri, n, t->expires);
+                break;
+            }
+        }
+        break;
+    }
+
+    if (pthread_rwlock_unlock(&ri->lock) != 0)
+        printf("rtu_timer: unlock FAILED\n");
+}
+
+/* Spread endpoints over rtu_threads by the device or the host name */
+static uint32_t rtu_hash(const struct rtu_desc *ri)
+{
+    const char *name = NULL;
+    uint32_t h = 2166136261u;
+    int port = 0;
+
+    if (ri->type == RTU) {
+        name = ri->cfg.serial.devname;
+    } else if (ri->type == UNIX) {
+        name = ri->cfg.name.sockfile;
+    } else {
+        name = ri->cfg.tcp.hostname;
+        port = ri->cfg.tcp.port;
+    }
+
+    for (; name && *name; ++name)
+        h = (h ^ (uint8_t)*name) * 16777619u;
+    h = (h ^ port) * 16777619u;
+
+    return h;
+}
+
+void *rtu_thread(void *arg)
+{
+    int ep;
+    int nevs;
+    int timeout = RTU_TICK;
+    struct rtu_desc *ri;
+    queue_list_v *qv;
+    struct queue_list *q;
+    struct epoll_event *evs;
+    struct timer_wheel *tw;
+    struct rtu_sched *self = (struct rtu_sched *)arg;
+    struct cfg *cfg = self->cfg;
+#ifndef _NUTTX_BUILD
+    int tfd;
+    struct epoll_event ev;
+    static struct rtu_chan wakeup_chan = { NULL, CHAN_WAKEUP };
+    static struct rtu_chan timer_chan = { NULL, CHAN_TIMER };
+#endif
+
+    /* Data and command channel per RTU, wakeup and timer */
+    nevs = self->nrtu * 2 + 2;
+
+    ep = epoll_create(nevs);
+    if (ep == -1) {
+        perror("epoll_create() failed");
+        return NULL;
+    }
+
+    evs = malloc(sizeof(struct epoll_event) * nevs);
+
+    tw = malloc(sizeof(struct timer_wheel));
+    timer_wheel_init(tw, clock_msec());
+
+#ifndef _NUTTX_BUILD
+    ev.events = EPOLLIN;
+    ev.data.ptr = &wakeup_chan;
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, self->evfd, &ev) == -1) {
+        perror("epoll_ctl(evfd) failed");
+        return NULL;
+    }
+
+    tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (tfd == -1) {
+        perror("timerfd_create() failed");
+        return NULL;
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = &timer_chan;
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, tfd, &ev) == -1) {
+        perror("epoll_ctl(timerfd) failed");
+        return NULL;
+    }
+
+    /* Wait for queries and deadlines only */
+    timeout = -1;
+#endif
 
     VFOREACH(cfg->rtu_list, ri) {
-        ri->conf = cfg;
+        if (ri->sched != self)
+            continue;
+        ri->tw = tw;
         rtu_open(ri, ep);
     }
 
-    fprintf(stderr, "RTU Ready: %08x %d\n", ep, VLEN(cfg->rtu_list));
+    fprintf(stderr, "RTU Ready[%d]: %08x %d\n", self->n, ep, self->nrtu);
 
     for (;;) {
         int n;
-        time_t cur_time;
-        int nfds = epoll_wait(ep, evs, VLEN(cfg->rtu_list), 100);
+        int pdulen;
+        int reqlen;
+        uint8_t pdu[BUF_SIZE];
+        struct mbuf *m;
+        uint8_t req[BUF_SIZE];
+        uint64_t now;
+        uint64_t next = 0;
+        int nfds = epoll_wait(ep, evs, nevs, timeout);
         if (nfds == -1 && errno != EAGAIN) {
-            if (errno == EINTR)
-                continue;
             perror("epoll_wait(rtu) failed");
 //            goto err;
         }
@@ -599,7 +1480,19 @@ void *rtu_thread(void *arg)
         /* Process RTU data */
         for (n = 0; n < nfds; ++n) {
             int len;
+            struct rtu_chan *ch = evs[n].data.ptr;
+
+#ifndef _NUTTX_BUILD
+            if (ch->type == CHAN_WAKEUP || ch->type == CHAN_TIMER) {
+                uint64_t v;
 
+                /* Just reset the counter, queues are processed below */
+                read(ch->type == CHAN_WAKEUP ? self->evfd : tfd, &v, sizeof(v));
+                continue;
+            }
+#endif
+
+            ri = ch->rtu;
             if (!(evs[n].events & EPOLLIN)) {
                 if (evs[n].events & EPOLLHUP) {
                     goto reconnect;
@@ -610,24 +1503,37 @@ void *rtu_thread(void *arg)
                 continue;
             }
 
-            /* Get RTU by descriptor */
-            ri = rtu_by_fd(cfg, evs[n].data.fd);
-            if (!ri) {
-                /* Should never happens, just clear the event */
-//                len = read(evs[n].data.fd, buf, BUF_SIZE);
-                rtu_close(ri, ep);
+#ifndef _NUTTX_BUILD
+            /* Process RealCOM command */
+            if (ch->type == CHAN_CMD) {
+                uint8_t cmd[BUF_SIZE];
+
+                len = read(ri->cfg.realcom.cmdfd, cmd, sizeof(cmd));
+                if (len <= 0)
+                    goto reconnect;
+                DEBUGF("Process CMD %d (#%d,#%d)\n", len, ri->fd, ri->cfg.realcom.cmdfd);
+                realcom_process_cmd(ri, cmd, len);
+                continue;
+            }
+#endif
+
+            if (ri->type == TCP) {
+                if (rtu_tcp_read(ri) < 0)
+                    goto reconnect;
                 continue;
             }
 
             if (ri->toreadbuf == NULL || ri->toread == 0) {
-                uint8_t *buf = malloc(512);
-                len = read(ri->fd, buf, 512);
+                /* Request buffer is free till the queue pass */
+                len = read(ri->fd, req, sizeof(req));
                 if (len <= 0)
                     goto reconnect;
+                if (ri->type == RTU)
+                    ri->tv = clock_usec();
                 printf("Unordered data received #%d\n", ri->fd);
-                dumpr(buf, len);
-                cache_update(ri, buf, len);
-                free(buf);
+                dumpr(req, len);
+                if (rtu_frame_check(req, len))
+                    cache_update(ri, req, len);
                 continue;
             } else {
                 len = read(ri->fd, ri->toreadbuf+ri->toread_off, ri->toread);
@@ -639,6 +1545,7 @@ reconnect:
                 /* Re-open required */
                 fprintf(stderr, "Read failed (%d), trying to re-open #%d\n",
                         errno, ri->fd);
+                rtu_requeue(ri);
                 rtu_close(ri, ep);
                 rtu_open(ri, ep);
                 continue;
@@ -647,215 +1554,405 @@ reconnect:
             dump(ri->toreadbuf, ri->toread_off + len);
             DEBUGF("\e[0m");
 
-#ifndef _NUTTX_BUILD
-            /* Process RealCOM command */
-            if (ri->type == REALCOM && ri->fd != evs[n].data.fd) {
-                DEBUGF("Process CMD %d (#%d,#%d)\n", len, ri->fd, evs[n].data.fd);
-                realcom_process_cmd(ri, ri->toreadbuf, len);
-                continue;
-            }
-#endif
-
             if (ri->type == RTU) {
-                if ((ri->toreadbuf[1] & 0xf0) == 0x80) {
-                    DEBUGF("...exception(#%d): %02x\n", ri->fd, ri->toreadbuf[1]);
-                    ri->toread = 0;
-                    ri->toread_off += len;
-                } else {
-                    ri->toread -= len;
-                    ri->toread_off += len;
-                }
+                int flen;
+
+                /* Update last serial activity timestamp */
+                ri->tv = clock_usec();
+                ri->toread_off += len;
+
+                /* Read exactly up to the end of the frame */
+                flen = rtu_frame_len(ri->toreadbuf, ri->toread_off);
+                if (flen > RTU_FRAME_MAX)
+                    flen = ri->toread_off;
+                if (flen > 0)
+                    ri->toread = flen - ri->toread_off;
+                else if (flen == 0)
+                    ri->toread = RTU_FRAME_MIN - ri->toread_off;
+                else
+                    ri->toread = RTU_FRAME_MAX - ri->toread_off;
                 if (ri->toread > 0) {
                     DEBUGF("...more(#%d): %d\n", ri->fd, ri->toread);
                     continue;
                 }
 
-                /* Update last serial activity timestamp */
-                gettimeofday(&ri->tv, NULL);
+                rtu_frame_done(cfg, ri);
+                continue;
             }
 
             /* Update cache */
             cache_update(ri, ri->toreadbuf, ri->toread_off);
-            free(ri->toreadbuf);
+            pool_free(ri->toreadbuf);
             ri->toread = 0;
             ri->toread_off = 0;
             ri->toreadbuf = NULL;
         }
 
-        if ((rc = pthread_rwlock_wrlock(&rwlock)) != 0) {
-            printf("rtu_thread: wrlock=%d\n", rc);
-            continue;
-        }
+        /* Drop expired cache pages and timed out queries */
+        now = clock_msec();
+        timer_expire(tw, now, rtu_timer, cfg);
+
+        VFOREACH(cfg->rtu_list, ri) {
+            if (ri->sched != self)
+                continue;
+
+            rtu_submit(cfg, ri);
+
+            if (!ri->fd) {
+                /* TODO: handle failed RTUs (number of attemps) and 
+                 *       answer to query for failed RTUs
+                 */
+                rtu_open(ri, ep);
+                continue;
+            }
+
+            /* Partial answer went silent, frames of unknown length end here */
+            if (ri->type == RTU && ri->toread > 0 && ri->toread_off > 0) {
+                if (clock_usec() - ri->tv > ri->char_timeout) {
+                    rtu_frame_done(cfg, ri);
+                } else {
+                    deadline_min(&next, ri->tv + ri->char_timeout + 1);
+                }
+            }
+
+            /* Queue is owned by rtu_thread, cache is only read here */
+
+            /* Process queue */
+            qv = &ri->q;
+            for (n = 0; n < VLEN(*qv); ++n) {
+                q = VGET(*qv, n);
+
+                /* New query, watch for its expiration */
+                if (q->timer.type == TIMER_NONE) {
+                    q->timer.type = TIMER_QUERY;
+                    q->timer.data = ri;
+                    timer_add(tw, &q->timer, q->expire);
+                }
+
+                /* Check for cache page */
+                pdulen = _cache_query(ri, q, pdu, sizeof(pdu), &m);
+                if (pdulen) {
+                    DEBUGF("Found %p, respond to #%d len=%d\n",
+                           q, q->resp_fd, pdulen);
+                    if (pdulen > 0) {
+                        /* Image data is shared by the waiters as well */
+                        m = m ? mbuf_get(m) : mbuf_new(pdu, pdulen);
+                        resp_post(ri, q, m);
+                        /* Not requested, answered from the cache */
+                        if (!q->answered)
+                            stat_add(&stat_slave(ri->stat, q->src)->hits, 1);
+                        _queue_fanout(cfg, ri, n, m, !q->answered);
+                        DEBUGF("\e[1;36m");
+                        dump(m ? m->data : pdu, pdulen);
+                        DEBUGF("\e[0m");
+                        mbuf_put(m);
+                    } else {
+                        printf("Too big packet(#%d)\n", ri->fd);
+                    }
+                    _queue_remove(ri, n);
+                    n--;
+                    continue;
+                } else if (q->stamp || q->lead) {
+                    /* Query is not completed yet or is covered by other read, check other */
+//                    DEBUGF("+++ requested #%d: stamp=%llu\n", ri->fd, q->stamp);
+                    continue;
+                } else if (ri->toread > 0) {
+//                    DEBUGF("+++ request pending #%d: %d\n", ri->fd, ri->toread);
+                    continue;
+                }
+
+                /* RTU Endpoint is alive */
+                if (ri->fd >= 0) {
+
+                    /* Do next request */
+                    if (ri->type == TCP) {
+                        /* Window is full, wait for answers */
+                        if (ri->inflight >= ri->window)
+                            continue;
+
+                        /* Fixup TID */
+                        _tid_assign(ri, q);
+
+                        /* Make request to TCP */
+                        reqlen = _queue_request(ri, q, req, sizeof(req));
+                        q->sent = clock_usec();
+                        if (write(ri->fd, req, reqlen) != reqlen) {
+                            perror("write() failed");
+                        }
+                        q->requested = 1;
+                    } else if (ri->type == RTU) {
+                        /* Nothing to read anymore, ready to transmit after t3.5 of silence */
+                        if (ri->toread <= 0 && clock_usec() - ri->tv > ri->frame_gap) {
+                            /* Make request to RTU */
+                            reqlen = _queue_request(ri, q, req, sizeof(req));
+                            q->sent = clock_usec();
+                            write(ri->fd, req, reqlen);
+                            /* Line is busy till the request is transmitted */
+                            ri->tv = q->sent + reqlen * ri->char_usec;
+                            /* Length of the answer is known from its header */
+                            ri->toread = RTU_FRAME_MIN;
+                            ri->toreadbuf = pool_zalloc(RTU_FRAME_MAX);
+                            q->requested = 1;
+//                            q->answered = 0;
+                            dump(req, reqlen);
+                            DEBUGF("! toreadbuf=%p (%d)\n", ri->toreadbuf, ri->toread);
+                            ri->toread_off = 0;
+                            DEBUGF("toread(#%d): %d\n", ri->fd, ri->toread);
+                        } else {
+                            DEBUGF("toread(#%d)==%d\n", ri->fd, ri->toread);
+                            /* Come back when the bus is free */
+                            deadline_min(&next, ri->tv + ri->frame_gap + 1);
+                            continue;
+                        }
+                    }
+                    DEBUGF("Write to RTU: #%d sid=%d l=%d\n", ri->fd, q->src, q->len);
+
+                }
+                q->stamp = clock_msec() + ri->timeout;
+                timer_add(tw, &q->timer, MIN(q->stamp, q->expire));
+
+                /* Serial line serves one transaction at a time */
+                if (ri->type != TCP)
+                    break;
+            }
+            stat_set(&ri->stat->queue, VLEN(ri->q));
+            stat_busy(ri->stat, ri->type == TCP ? ri->inflight > 0 : ri->toread > 0, clock_usec());
+        }
+
+        /* Answers of the pass are posted, wake up their tcp_threads */
+        if (resp_flush(self))
+            deadline_min(&next, clock_usec() + RESP_RETRY);
+        resp_wakeup(self);
+
+        if ((now = timer_next(tw)))
+            deadline_min(&next, now * 1000);
+#ifndef _NUTTX_BUILD
+        deadline_arm(tfd, next);
+#endif
+    }
+
+err:
+    return NULL;
+}
+
+#ifndef _NUTTX_BUILD
+/* Answer the stats command with the text report */
+static void conn_stats(struct cfg *cfg, int fd)
+{
+    size_t len;
+    char *buf = stats_report(cfg, &len);
+
+    if (!buf)
+        return;
+    wbqueue_add(cfg, fd, conn_gen(cfg, fd), (uint8_t *)buf, len);
+    free(buf);
+}
+#endif
+
+/*
+ * Read requests of the client and process all complete MBAP frames,
+ * the incomplete tail is kept till the next read.
+ * Returns -1 if the connection has to be closed.
+ */
+static int conn_read(struct cfg *cfg, int fd)
+{
+    struct conn *c;
+    struct mbap_req req[MAX_BATCH];
+    uint32_t off = 0;
+    int nreq = 0;
+    int len;
+
+    if (!(c = conn_by_fd(cfg, fd)))
+        return -1;
+
+    if (!c->ibuf && !(c->ibuf = malloc(CONN_IBUF_SIZE)))
+        return -1;
+
+    len = read(fd, c->ibuf + c->ilen, CONN_IBUF_SIZE - c->ilen);
+    if (len == 0)
+        return -1;
+    if (len < 0)
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    c->ilen += len;
+
+    while (c->ilen - off >= 5) {
+        uint8_t *frame = c->ibuf + off;
+        int flen;
+
+#ifndef _NUTTX_BUILD
+        /* Text command of the UNIX socket, it's never a valid MBAP header */
+        if (c->local && !memcmp(frame, "stats", 5)) {
+            uint8_t *eol = memchr(frame, '\n', c->ilen - off);
+
+            if (!eol)
+                break;
+            conn_stats(cfg, fd);
+            off = eol + 1 - c->ibuf;
+            continue;
+        }
+#endif
+        if (c->ilen - off < 8)
+            break;
+        flen = 6 + ((frame[4] << 8) | frame[5]);
+
+        /* Check for MODBUS magic, the stream can't be resynced */
+        if (frame[2] != 0 || frame[3] != 0 || flen < 8 || flen > MBAP_FRAME_MAX) {
+            printf("Broken MBAP header from #%d\n", fd);
+            dumpr(frame, c->ilen - off);
+            return -1;
+        }
+        if (c->ilen - off < flen)
+            break;
+
+        dump(frame, flen);
+        req[nreq].buf = frame;
+        req[nreq].len = flen;
+        if (++nreq == MAX_BATCH) {
+            queue_batch(cfg, fd, req, nreq);
+            nreq = 0;
+        }
+        off += flen;
+    }
+    if (nreq)
+        queue_batch(cfg, fd, req, nreq);
+
+    c->ilen -= off;
+    if (off && c->ilen)
+        memmove(c->ibuf, c->ibuf + off, c->ilen);
+
+    return 0;
+}
+
+/* MODBUS-TCP listener, tcp_threads bind their own ones with SO_REUSEPORT */
+static int listen_tcp(void)
+{
+#ifndef _NUTTX_BUILD
+    struct sockaddr_in6 sin6;
+#else
+    struct sockaddr_in sin;
+#endif
+    int on = 1;
+    int sd;
+
+#ifndef _NUTTX_BUILD
+    if ((sd = socket(AF_INET6, SOCK_STREAM, 0)) < 0) {
+#else
+    if ((sd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+#endif
+        perror("socket(AF_INET6) failed");
+        return -1;
+    }
+
+    if (setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, (char *)&on, sizeof(on)) < 0) {
+        perror("setsockopt() failed");
+        goto err;
+    }
 
-        cur_time = time(NULL);
-        VFOREACH(cfg->rtu_list, ri) {
-            if (!ri->fd) {
-                /* TODO: handle failed RTUs (number of attemps) and 
-                 *       answer to query for failed RTUs
-                 */
-                rtu_open(ri, ep);
-                continue;
-            }
+#ifndef _NUTTX_BUILD
+    if (setsockopt(sd, SOL_SOCKET, SO_REUSEPORT, (char *)&on, sizeof(on)) < 0) {
+        perror("setsockopt(SO_REUSEPORT) failed");
+        goto err;
+    }
 
-            /* Invalidate cache pages */
-            p = ri->p;
-            while (p) {
-                //DEBUGF("-- cache: %lu <> %lu\n", p->ttd, cur_time);
-                if (p->ttd && p->ttd <= cur_time) {
-                    p = _page_free(ri, p);
-                    continue;
-                }
-                p = p->next;
-            }
+    memset(&sin6, 0, sizeof(sin6));
+    sin6.sin6_family = AF_INET6;
+    sin6.sin6_port = htons(MODBUS_TCP_PORT);
+    sin6.sin6_addr = in6addr_any;
 
-            /* Process queue */
-            qv = &ri->q;
-            for (n = 0; n < VLEN(*qv); ++n) {
-                /* Check for timeouted items */
-                q = &VGET(*qv, n);
+    /* Bind to IPv6 */
+    if (bind(sd, (struct sockaddr *)&sin6, sizeof(sin6)) < 0) {
+        perror("bind(sd) failed");
+        goto err;
+    }
+#else
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(MODBUS_TCP_PORT);
+    sin.sin_addr.s_addr = htonl(0x0a000002);
 
-                /* Check for cache page */
-                p = _cache_find(ri, q);
-                if (p) {
-                    DEBUGF("Found %p, respond to #%d len=%d\n",
-                           q, q->resp_fd, p->len);
-                    if (ri->type == TCP) {
-#if 1
-                        /* Revert TID back */
-                        p->buf[0] = q->tido[0];
-                        p->buf[1] = q->tido[1];
+    /* Bind to IPv4 */
+    if (bind(sd, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+        perror("bind(sd) failed");
+        goto err;
+    }
 #endif
-                        _wbqueue_add(cfg, q->resp_fd, p->buf, p->len);
-                    } else if (ri->type == RTU) {
-                        uint8_t tcp[520];
-                        tcp[0] = q->tido[0];
-                        tcp[1] = q->tido[1];
-                        tcp[2] = tcp[3] = 0;
-                        tcp[4] = (p->len >> 8) & 0xff;
-                        tcp[5] =  p->len & 0xff;
-                        tcp[6] = q->src;
-                        if (p->len < 511) {
-                            memcpy(tcp+7, p->buf+1, p->len-1);
-                            _wbqueue_add(cfg, q->resp_fd, tcp, p->len + 6);
-                            DEBUGF("\e[1;36m");
-                            dump(tcp, p->len + 6);
-                            DEBUGF("\e[0m");
-                        } else {
-                            printf("Too big packet(#%d): %d\n", ri->fd, p->len);
-                        }
-                    }
-                    _queue_remove(ri, n);
-                    n--;
-                    continue;
-                } else if ((q->stamp && q->stamp <= cur_time) || (q->expire <= cur_time)) {
-                    // build response with TIMEOUT error message
-                    uint8_t errbuf[] = { 0x00, 0x01, 0x00, 0x00, 0x00, 0x03, 0x01, 0x83, 0x05, 0x00, 0x00 };
-
-                    DEBUGF("Remove from queue(%d) #%d %p: sid=%d stamp=%ld,exp=%ld %ld\n", VLEN(*qv), ri->fd, q, q->buf[0], q->stamp, q->expire, cur_time);
-
-                    errbuf[0] = q->tido[0];
-                    errbuf[1] = q->tido[1];
-                    errbuf[6] = q->buf[0];
-                    errbuf[7] = q->function | 0x80;
-
-                    /* Slave is busy */
-                    if (q->expire <= cur_time)
-                        errbuf[8] = 0x06;
-
-                    /* Update cache with fective CRC */
-                    _cache_update(ri, q, errbuf + 6, 5);
-
-                    /* Reset `toread' buffer on query timeout */
-                    if (q->stamp && ri->toreadbuf) {
-                        free(ri->toreadbuf);
-                        ri->toread = 0;
-                        ri->toread_off = 0;
-                        ri->toreadbuf = NULL;
-                    }
-
-                    if (q->resp_fd >= 0) {
-                        _wbqueue_add(cfg, q->resp_fd, errbuf, sizeof(errbuf) - 2);
-                    }
-                    _queue_remove(ri, n);
-                    n--;
-                    continue;
-                } else if (q->stamp) {
-                    /* Query is not completed yet, check other */
-//                    DEBUGF("+++ requested #%d: stamp=%ld\n", ri->fd, q->stamp);
-                    continue;
-                } else if (ri->toread > 0) {
-//                    DEBUGF("+++ request pending #%d: %d\n", ri->fd, ri->toread);
-                    continue;
-                }
+    if (listen(sd, LISTEN_BACKLOG) < 0 || setnonblocking(sd) != 0) {
+        perror("listen(sd) failed");
+        goto err;
+    }
 
-                /* RTU Endpoint is alive */
-                if (ri->fd >= 0) {
+    return sd;
 
-                    /* Do next request */
-                    if (ri->type == TCP) {
-#if 1
-                        /* Fixup TID */
-                        q->buf[0] = ri->tid >> 8;
-                        q->buf[1] = ri->tid & 0xff;
-                        ri->tid++;
-                        /* Zero is not allowed as TID */
-                        if (!ri->tid)
-                            ri->tid ^= 1;
-#endif
-                        /* Make request to TCP */
-                        if (write(ri->fd, q->buf, q->len) != q->len) {
-                            perror("write() failed");
-                        }
-                    } else if (ri->type == RTU) {
-                        struct timeval tv;
-                        gettimeofday(&tv, NULL);
+err:
+    close(sd);
+    return -1;
+}
 
-                        /* Nothing to read anymore, ready to transmit more (200msec delay) */
-                        if (ri->toread <= 0 && ((tv.tv_sec - ri->tv.tv_sec) > 0 || (tv.tv_usec - ri->tv.tv_usec) > 35000)) {
-                            /* Make request to RTU */
-                            write(ri->fd, q->buf, q->len);
-                            // status register
-                            if (q->buf[1] == 1) {
-                                int numregs;
-                                numregs = (q->buf[4] << 8) | q->buf[5];
-                                ri->toread = (numregs >> 3) + (numregs % 8 > 0 ? 1 : 0) + 5;
-                            } else if (q->buf[1] == 2) {
-                                ri->toread = 6;
-                            } else {
-                                ri->toread = ((q->buf[4] << 8) | q->buf[5]) * 2 + 5;
-                            }
-                            ri->toreadbuf = calloc(1, ri->toread);
-                            q->requested = 1;
-//                            q->answered = 0;
-                            dump(q->buf, q->len);
-                            DEBUGF("! toreadbuf=%p (%d)\n", ri->toreadbuf, ri->toread);
-                            ri->toread_off = 0;
-                            DEBUGF("toread(#%d): %d\n", ri->fd, ri->toread);
-                        } else {
-                            DEBUGF("toread(#%d)==%d\n", ri->fd, ri->toread);
-                            continue;
-                        }
-                    }
-                    DEBUGF("Write to RTU: #%d sid=%d l=%d\n", ri->fd, q->src, q->len);
+/* Accept pending connections of the listener, they are served by this thread */
+static void conn_accept(struct workers *self, int l)
+{
+    struct cfg *cfg = self->cfg;
+    struct epoll_event ev;
+    struct conn *cn;
+    int c;
 
-                }
-                q->stamp = time(NULL) + ri->timeout;
-                break;
+    for (;;) {
+#ifndef _NUTTX_BUILD
+        c = accept4(l, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+        c = accept(l, NULL, NULL);
+#endif
+        if (c < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            perror("accept()");
+            if ((errno == EMFILE || errno == ENFILE) && self->spare >= 0) {
+                /* Out of descriptors, shed the connection instead of spinning on it */
+                close(self->spare);
+                c = accept(l, NULL, NULL);
+                if (c >= 0)
+                    close(c);
+                self->spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
             }
+            return;
         }
 
-        if (pthread_rwlock_unlock(&rwlock) != 0)
-            printf("rtu_thread: unlock FAILED\n");
-    }
+#ifdef _NUTTX_BUILD
+        if (setnonblocking(c) != 0) {
+            perror("setnonblocking()");
+            close(c);
+            continue;
+        }
+#endif
+        if (c >= cfg->maxconns) {
+            printf("Too many connections #%d\n", c);
+            close(c);
+            continue;
+        }
 
-err:
-    return NULL;
+        cn = conn_by_fd(cfg, c);
+        pthread_mutex_lock(&cn->lock);
+        cn->ep = self->ep;
+        cn->worker = self->n;
+        cn->armed = 0;
+        cn->local = (l == self->ud);
+        pthread_mutex_unlock(&cn->lock);
+
+        /* EPOLLOUT is watched only while answers are pending */
+        ev.events = EPOLLIN;
+        ev.data.fd = c;
+        if (epoll_ctl(self->ep, EPOLL_CTL_ADD, c, &ev) < 0) {
+            perror("epoll_ctl ADD()");
+            close(c);
+        }
+    }
 }
 
 void *tcp_thread(void *p)
 {
     int n;
-    uint8_t buf[260];
     struct workers *self = (struct workers *)p;
     struct epoll_event evs[MAX_EVENTS];
 
@@ -866,6 +1963,7 @@ void *tcp_thread(void *p)
 #else
         int nfds = epoll_wait(self->ep, evs, MAX_EVENTS, -1);
 #endif
+        uint64_t start = clock_usec();
 
         if (nfds == -1 && errno != EAGAIN) {
             if (errno == EINTR)
@@ -875,58 +1973,31 @@ void *tcp_thread(void *p)
 //            goto err;
         }
 
+#ifdef _NUTTX_BUILD
+        /* No eventfd, answers are picked up on every tick */
+        resp_drain(self);
+#endif
+
         for (n = 0; n < nfds; ++n) {
-            int len;
+            if (evs[n].data.fd == self->sd || evs[n].data.fd == self->ud) {
+                conn_accept(self, evs[n].data.fd);
+                continue;
+            }
+#ifndef _NUTTX_BUILD
+            if (evs[n].data.fd == self->evfd) {
+                uint64_t v;
 
+                read(self->evfd, &v, sizeof(v));
+                resp_drain(self);
+                continue;
+            }
+#endif
             if (evs[n].events & EPOLLIN) {
-
-                len = read(evs[n].data.fd, buf, 6);
-                if (len == 0) {
-//c_close:
+                if (conn_read(self->cfg, evs[n].data.fd) < 0) {
                     epoll_ctl(self->ep, EPOLL_CTL_DEL, evs[n].data.fd, NULL);
-                    perror("tcp_thread len=0");
+                    DEBUGF("tcp_thread: close #%d\n", evs[n].data.fd);
                     wbqueue_free(self->cfg, evs[n].data.fd);
                     continue;
-                } else if (len < 0) {
-                    perror("Error occured");
-                } else if (len == 6) {
-                    int pktlen;
-                    int pkt_count = 0;
-
-                    dump(buf, len);
-
-                    while (1) {
-                        /* Check for MODBUS magic */
-                        if (buf[2] != 0 || buf[3] != 0) {
-                            break;
-                        }
-
-                        /* Read packet data */
-                        pktlen = buf[5];
-                        DEBUGF("**** pktlen=%d\n", pktlen);
-                        len = read(evs[n].data.fd, buf+6, pktlen);
-                        if (len <= 0) {
-                            if (errno == EAGAIN)
-                                perror("*** data");
-                            break;
-                        }
-
-                        dump(buf, pktlen + 6);
-                        if (len != pktlen) {
-                            DEBUGF("!!! not enough data to read: %d/%d\n", len, pktlen);
-                            break;
-                        }
-                        queue_add(self->cfg, buf[6], evs[n].data.fd, buf, pktlen + 6);
-
-                        /* HACK: Limit each client with N packets */
-                        if (++pkt_count == 20)
-                            break;
-
-                        /* Read next header */
-                        len = read(evs[n].data.fd, buf, 6);
-                        if (len <= 0)
-                            break;
-                    }
                 }
             }
 
@@ -941,6 +2012,13 @@ void *tcp_thread(void *p)
                 wbqueue_free(self->cfg, evs[n].data.fd);
             }
         }
+
+        /* Time of the loop, waiting excluded */
+        start = clock_usec() - start;
+        stat_add(&self->stat->loops, 1);
+        stat_add(&self->stat->loop_usec, start);
+        if (start > self->stat->loop_max)
+            stat_set(&self->stat->loop_max, start);
     }
 
 err:
@@ -963,26 +2041,25 @@ int mbusgw_main(int argc, FAR char *argv[])
 int main(int argc, char *argv[])
 #endif
 {
-    int c;
     int n;
-    int rc;
-    int sd;
-    int ud;
     int ep;
-    int cur_child = 0;
-    pthread_t rtu_proc;
     pthread_attr_t attr;
-    struct sockaddr_un name;
 #ifndef _NUTTX_BUILD
-    struct sockaddr_in6 sin6;
+    struct sockaddr_un name;
+    sigset_t sigs;
+    int sfd;
+    int ud;
 #else
-    struct sockaddr_in sin;
+    int sd;
 #endif
     struct epoll_event ev;
     struct epoll_event evs[2];
+    struct rtu_desc *ri;
     struct cfg *cfg;
     static struct workers *workers;
 
+    crc16_init();
+
     cfg = cfg_load("mbus.conf");
     if (!cfg) {
         return 1;
@@ -994,72 +2071,31 @@ int main(int argc, char *argv[])
     }
 
 #ifndef _NUTTX_BUILD
-    if ((sd = socket(AF_INET6, SOCK_STREAM, 0)) < 0) {
-#else
-    if ((sd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-#endif
-        perror("socket(AF_INET6) failed");
-        return 1;
-    }
+    signal(SIGPIPE, SIG_IGN);
 
-#ifndef _NUTTX_BUILD
+    /* UNIX socket is shared by tcp_threads, MODBUS-TCP listeners are per thread */
     if ((ud = socket(PF_LOCAL, SOCK_STREAM, 0)) < 0) {
         perror("socket(PF_LOCAL) failed");
         return 1;
     }
-#endif
-
-    n = 1;
-    if (setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, (char *)&n, sizeof(n)) < 0) {
-        perror("setsockopt() failed");
-        return 1;
-    }
 
     memset(&name, 0, sizeof(name));
-#ifndef _NUTTX_BUILD
-    memset(&sin6, 0, sizeof(sin6));
-    sin6.sin6_family = AF_INET6;
-    sin6.sin6_port = htons(MODBUS_TCP_PORT);
-    sin6.sin6_addr = in6addr_any;
-#else
-    memset(&sin, 0, sizeof(sin));
-    sin.sin_family = AF_INET;
-    sin.sin_port = htons(MODBUS_TCP_PORT);
-    sin.sin_addr.s_addr = htonl(0x0a000002);
-#endif
     name.sun_family = AF_LOCAL;
     strcpy(name.sun_path, cfg->sockfile);
 
-#ifndef _NUTTX_BUILD
-    signal(SIGPIPE, SIG_IGN);
-
-    /* Bind to IPv6 */
-    if (bind(sd, (struct sockaddr *)&sin6, sizeof(sin6)) < 0) {
-        perror("bind(sd) failed");
-        return 1;
-    }
-#else
-    /* Bind to IPv4 */
-    if (bind(sd, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
-        perror("bind(sd) failed");
-        return 1;
-    }
-#endif
-    if (listen(sd, MAX_EVENTS >> 1) < 0) {
-        perror("listen(sd) failed");
-        return 1;
-    }
-
-#ifndef _NUTTX_BUILD
     /* Bind to UNIX socket */
     if (bind(ud, (struct sockaddr *)&name, SUN_LEN(&name)) < 0) {
         perror("bind(ud) failed");
         return 1;
     }
-    if (listen(ud, MAX_EVENTS >> 1) < 0) {
+    if (listen(ud, LISTEN_BACKLOG) < 0 || setnonblocking(ud) != 0) {
         perror("listen(ud) failed");
         return 1;
     }
+#else
+    /* No SO_REUSEPORT, tcp_threads share the listener */
+    if ((sd = listen_tcp()) < 0)
+        return 1;
 #endif
 
     ep = epoll_create(2);
@@ -1068,40 +2104,70 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    ev.events = EPOLLIN | EPOLLERR;
-    ev.data.fd = sd;
-
-    if (epoll_ctl(ep, EPOLL_CTL_ADD, sd, &ev) == -1) {
-        perror("epoll_ctl(sd) failed");
+#ifndef _NUTTX_BUILD
+    /* Allocator statistics are printed on SIGUSR1, threads inherit the mask */
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+    sfd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sfd == -1) {
+        perror("signalfd() failed");
         return 1;
     }
-
-#ifndef _NUTTX_BUILD
-    ev.events = EPOLLIN | EPOLLERR;
-    ev.data.fd = ud;
-
-    if (epoll_ctl(ep, EPOLL_CTL_ADD, ud, &ev) == -1) {
-        perror("epoll_ctl(ud) failed");
+    ev.events = EPOLLIN;
+    ev.data.fd = sfd;
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, sfd, &ev) == -1) {
+        perror("epoll_ctl(sfd) failed");
         return 1;
     }
 #endif
 
-    /* Pre-fork threads */
-    pthread_rwlock_init(&rwlock, NULL);
+    if (conn_init(cfg) < 0) {
+        perror("conn_init() failed");
+        return 1;
+    }
 
-    pthread_attr_init(&attr);
-#ifdef PTHREAD_CREATE_DETACHED
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    cfg->sched = calloc(cfg->rtu_threads, sizeof(struct rtu_sched));
+    for (n = 0; n < cfg->rtu_threads; ++n) {
+        cfg->sched[n].n = n;
+        cfg->sched[n].cfg = cfg;
+        cfg->sched[n].wake = calloc(cfg->workers, 1);
+        cfg->sched[n].held = calloc(cfg->workers, sizeof(struct resp *));
+        cfg->sched[n].held_tail = calloc(cfg->workers, sizeof(struct resp *));
+#ifndef _NUTTX_BUILD
+        cfg->sched[n].evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (cfg->sched[n].evfd == -1) {
+            perror("eventfd() failed");
+            return 1;
+        }
 #endif
-    if (pthread_create(&rtu_proc, &attr, rtu_thread, cfg) < 0) {
-        perror("pthread_create() failed");
-        return 2;
     }
-#ifndef PTHREAD_CREATE_DETACHED
-    pthread_detach(rtu_proc);
-#endif
+
+    /* Pre-fork threads */
+    VFOREACH(cfg->rtu_list, ri) {
+        pthread_rwlock_init(&ri->lock, NULL);
+        if (ring_init(&ri->sq, SUBMIT_RING) < 0) {
+            perror("ring_init() failed");
+            return 1;
+        }
+        if (ri->thread >= cfg->rtu_threads) {
+            printf("RTU thread %d is not configured (rtu_threads: %d)\n",
+                   ri->thread, cfg->rtu_threads);
+            return 1;
+        }
+        n = ri->thread >= 0 ? ri->thread : rtu_hash(ri) % cfg->rtu_threads;
+        ri->sched = &cfg->sched[n];
+        ri->sched->nrtu++;
+        ri->conf = cfg;
+    }
 
     workers = malloc(sizeof(struct workers) * cfg->workers);
+    cfg->wk = workers;
+
+    if (stats_init(cfg) < 0) {
+        perror("stats_init() failed");
+        return 1;
+    }
 
     for (n = 0; n < cfg->workers; ++n) {
         pthread_attr_init(&attr);
@@ -1115,6 +2181,48 @@ int main(int argc, char *argv[])
             perror("epoll_create() failed");
             return 3;
         }
+        if (ring_init(&workers[n].rq, RESP_RING) < 0) {
+            perror("ring_init() failed");
+            return 1;
+        }
+#ifndef _NUTTX_BUILD
+        workers[n].evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (workers[n].evfd == -1) {
+            perror("eventfd() failed");
+            return 1;
+        }
+        ev.events = EPOLLIN;
+        ev.data.fd = workers[n].evfd;
+        if (epoll_ctl(workers[n].ep, EPOLL_CTL_ADD, workers[n].evfd, &ev) < 0) {
+            perror("epoll_ctl(evfd) failed");
+            return 3;
+        }
+
+        /* Kernel spreads new connections over the threads */
+        workers[n].sd = listen_tcp();
+        if (workers[n].sd < 0)
+            return 1;
+        workers[n].ud = ud;
+        workers[n].spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+        /* Only one of the threads is woken per UNIX connection */
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.fd = ud;
+        if (epoll_ctl(workers[n].ep, EPOLL_CTL_ADD, ud, &ev) < 0) {
+            perror("epoll_ctl(ud) failed");
+            return 3;
+        }
+#else
+        workers[n].sd = sd;
+        workers[n].ud = -1;
+        workers[n].spare = -1;
+#endif
+        ev.events = EPOLLIN;
+        ev.data.fd = workers[n].sd;
+        if (epoll_ctl(workers[n].ep, EPOLL_CTL_ADD, workers[n].sd, &ev) < 0) {
+            perror("epoll_ctl(sd) failed");
+            return 3;
+        }
         if (pthread_create(&workers[n].th, &attr, tcp_thread, &workers[n]) < 0) {
             perror("pthread_create() failed");
             return 2;
@@ -1124,66 +2232,43 @@ int main(int argc, char *argv[])
 #endif
     }
 
-    for (;;) {
-#ifndef _NUTTX_BUILD
-        struct sockaddr_in6 local;
-#else
-        struct sockaddr_in local;
+    for (n = 0; n < cfg->rtu_threads; ++n) {
+        pthread_attr_init(&attr);
+#ifdef PTHREAD_CREATE_DETACHED
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
 #endif
-        socklen_t addrlen = sizeof(local);
+        if (pthread_create(&cfg->sched[n].th, &attr, rtu_thread, &cfg->sched[n]) < 0) {
+            perror("pthread_create() failed");
+            return 2;
+        }
+#ifndef PTHREAD_CREATE_DETACHED
+        pthread_detach(cfg->sched[n].th);
+#endif
+    }
+
+    /* Connections are accepted by tcp_threads */
+    for (;;) {
         int nfds;
 
-        nfds = epoll_wait(ep, evs, 1, -1);
+        nfds = epoll_wait(ep, evs, 2, -1);
         if (nfds == -1) {
             if (errno == EINTR)
                 continue;
             perror("epoll_wait(main) failed");
             return 2;
-        } else if (nfds == 0) {
-            continue;
         }
 
+#ifndef _NUTTX_BUILD
         for (n = 0; n < nfds; ++n) {
-            if (!(evs[n].events & EPOLLIN))
-                continue;
-
-//            fprintf(stderr, "%d events=%d\n", nfds, evs[0].events);
-
-            c = accept(evs[n].data.fd, (struct sockaddr *)&local, &addrlen);
-
-            if (c < 0) {
-                if (errno == ENOTCONN)
-                    continue;
-                perror("accept()");
-                /* HACK: unable to accept more incoming connections */
-                rc = -1;
-                goto die;
-            }
+            if (evs[n].data.fd == sfd) {
+                struct signalfd_siginfo si;
 
-            if (setnonblocking(c) < 0) {
-                perror("setnonblocking()");
-                close(c);
-            } else {
-                ev.events = EPOLLIN | EPOLLOUT;
-                ev.data.fd = c;
-//                fprintf(stderr, "%d Adding() %d %d\n", evs[n].data.fd, c, ((struct sockaddr_in *)&local)->sin_port);
-//                fprintf(stderr, "%d Adding() %d %d\n", ep, c, ((struct sockaddr_in6 *)&local)->sin6_port);
-                if (epoll_ctl(workers[cur_child++].ep, EPOLL_CTL_ADD, c, &ev) < 0) {
-                    perror("epoll_ctl ADD()");
-                    close(c);
-                }
-                cur_child %= cfg->workers;
+                while (read(sfd, &si, sizeof(si)) == sizeof(si))
+                    pool_dump();
             }
         }
-    }
-
-    rc = 0;
-die:
-    pthread_rwlock_destroy(&rwlock);
-#ifndef _NUTTX_BUILD
-    close(ud);
 #endif
-    close(sd);
+    }
 
     return 0;
 }
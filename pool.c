@@ -0,0 +1,277 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "pool.h"
+
+#define POOL_LARGE      POOL_CLASSES
+
+/* Header in front of the object, keeps 16 bytes alignment */
+struct pool_obj {
+    struct pool_obj *next;  /* free list link */
+    uint32_t cls;
+} __attribute__((aligned(16)));
+
+/* Shared list of the class, objects of all slabs are linked here first */
+struct pool_class {
+    pthread_mutex_t lock;
+    struct pool_obj *free;
+    uint32_t count;
+    uint64_t slabs;
+};
+
+/* Free lists and counters of the thread */
+struct pool_cache {
+    struct pool_obj *free[POOL_CLASSES];
+    uint32_t count[POOL_CLASSES];
+    uint64_t allocs[POOL_CLASSES + 1];
+    uint64_t frees[POOL_CLASSES + 1];
+    struct pool_cache *next; /* all caches, for statistics */
+};
+
+static struct pool_class classes[POOL_CLASSES] = {
+    [0 ... POOL_CLASSES - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+
+static pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pool_cache *caches;
+
+#ifdef _NUTTX_BUILD
+/* No thread local storage, all threads share one cache */
+static struct pool_cache shared;
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct pool_cache *cache_enter(void)
+{
+    pthread_mutex_lock(&shared_lock);
+    if (!caches)
+        caches = &shared;
+    return &shared;
+}
+
+static inline void cache_leave(void)
+{
+    pthread_mutex_unlock(&shared_lock);
+}
+#else
+/* Threads of the gateway never exit, caches are not reclaimed */
+static __thread struct pool_cache *tcache;
+
+static struct pool_cache *cache_enter(void)
+{
+    if (tcache)
+        return tcache;
+
+    tcache = calloc(1, sizeof(struct pool_cache));
+    if (!tcache)
+        return NULL;
+
+    pthread_mutex_lock(&caches_lock);
+    tcache->next = caches;
+    caches = tcache;
+    pthread_mutex_unlock(&caches_lock);
+
+    return tcache;
+}
+
+static inline void cache_leave(void)
+{
+}
+#endif
+
+static inline size_t pool_size(int cls)
+{
+    return (size_t)1 << (cls + POOL_MIN_SHIFT);
+}
+
+static inline int pool_class(size_t size)
+{
+    int cls;
+
+    for (cls = 0; cls < POOL_CLASSES; ++cls) {
+        if (size <= pool_size(cls))
+            return cls;
+    }
+
+    return -1;
+}
+
+/* Take a batch of objects from the shared list, carve a new slab if it's empty */
+static struct pool_obj *pool_refill(struct pool_cache *tc, int cls)
+{
+    struct pool_class *pc = &classes[cls];
+    size_t size = pool_size(cls);
+    struct pool_obj *o;
+    int n;
+
+    pthread_mutex_lock(&pc->lock);
+    if (!pc->free) {
+        size_t len = size * POOL_BATCH > POOL_SLAB ? size * POOL_BATCH : POOL_SLAB;
+        uint8_t *slab = malloc(len);
+
+        if (slab) {
+            for (n = len / size - 1; n >= 0; --n) {
+                o = (struct pool_obj *)(slab + n * size);
+                o->cls = cls;
+                o->next = pc->free;
+                pc->free = o;
+            }
+            pc->count += len / size;
+            pc->slabs++;
+        }
+    }
+
+    for (n = 0; n < POOL_BATCH && pc->free; ++n) {
+        o = pc->free;
+        pc->free = o->next;
+        o->next = tc->free[cls];
+        tc->free[cls] = o;
+    }
+    pc->count -= n;
+    tc->count[cls] += n;
+    pthread_mutex_unlock(&pc->lock);
+
+    return tc->free[cls];
+}
+
+/* Return a batch of objects to the shared list */
+static void pool_release(struct pool_cache *tc, int cls)
+{
+    struct pool_class *pc = &classes[cls];
+    struct pool_obj *o;
+    int n;
+
+    pthread_mutex_lock(&pc->lock);
+    for (n = 0; n < POOL_BATCH && tc->free[cls]; ++n) {
+        o = tc->free[cls];
+        tc->free[cls] = o->next;
+        o->next = pc->free;
+        pc->free = o;
+    }
+    pc->count += n;
+    tc->count[cls] -= n;
+    pthread_mutex_unlock(&pc->lock);
+}
+
+void *pool_alloc(size_t size)
+{
+    int cls = pool_class(size + sizeof(struct pool_obj));
+    struct pool_cache *tc;
+    struct pool_obj *o;
+
+    tc = cache_enter();
+    if (!tc)
+        return NULL;
+
+    if (cls < 0) {
+        tc->allocs[POOL_LARGE]++;
+        cache_leave();
+        o = malloc(sizeof(struct pool_obj) + size);
+        if (!o)
+            return NULL;
+        o->cls = POOL_LARGE;
+        return o + 1;
+    }
+
+    o = tc->free[cls];
+    if (!o && !(o = pool_refill(tc, cls))) {
+        cache_leave();
+        return NULL;
+    }
+    tc->free[cls] = o->next;
+    tc->count[cls]--;
+    tc->allocs[cls]++;
+    cache_leave();
+
+    return o + 1;
+}
+
+void *pool_zalloc(size_t size)
+{
+    void *ptr = pool_alloc(size);
+
+    if (ptr)
+        memset(ptr, 0, size);
+
+    return ptr;
+}
+
+void pool_free(void *ptr)
+{
+    struct pool_obj *o;
+    struct pool_cache *tc;
+    int cls;
+
+    if (!ptr)
+        return;
+
+    o = (struct pool_obj *)ptr - 1;
+    cls = o->cls;
+
+    tc = cache_enter();
+    if (!tc) {
+        /* Can't happen for the thread which allocated anything */
+        if (cls == POOL_LARGE)
+            free(o);
+        return;
+    }
+    tc->frees[cls]++;
+
+    if (cls == POOL_LARGE) {
+        cache_leave();
+        free(o);
+        return;
+    }
+
+    o->next = tc->free[cls];
+    tc->free[cls] = o;
+    /* Objects freed by the consumer go back to the producer */
+    if (++tc->count[cls] > 2 * POOL_BATCH)
+        pool_release(tc, cls);
+    cache_leave();
+}
+
+/* Sum counters of all threads, `st' has POOL_CLASSES + 1 entries */
+void pool_stats(struct pool_stat *st)
+{
+    struct pool_cache *tc;
+    int cls;
+
+    memset(st, 0, sizeof(struct pool_stat) * (POOL_CLASSES + 1));
+
+    for (cls = 0; cls < POOL_CLASSES; ++cls) {
+        st[cls].size = pool_size(cls) - sizeof(struct pool_obj);
+        pthread_mutex_lock(&classes[cls].lock);
+        st[cls].slabs = classes[cls].slabs;
+        st[cls].idle = classes[cls].count;
+        pthread_mutex_unlock(&classes[cls].lock);
+    }
+
+    /* Counters of other threads are read on the fly */
+    pthread_mutex_lock(&caches_lock);
+    for (tc = caches; tc; tc = tc->next) {
+        for (cls = 0; cls <= POOL_CLASSES; ++cls) {
+            st[cls].allocs += tc->allocs[cls];
+            st[cls].frees += tc->frees[cls];
+        }
+    }
+    pthread_mutex_unlock(&caches_lock);
+}
+
+void pool_dump(void)
+{
+    struct pool_stat st[POOL_CLASSES + 1];
+    int cls;
+
+    pool_stats(st);
+
+    printf("pool: size allocs frees in-use slabs idle\n");
+    for (cls = 0; cls <= POOL_CLASSES; ++cls) {
+        printf("pool: %4zu %llu %llu %llu %llu %llu\n", st[cls].size,
+               (unsigned long long)st[cls].allocs, (unsigned long long)st[cls].frees,
+               (unsigned long long)(st[cls].allocs - st[cls].frees),
+               (unsigned long long)st[cls].slabs, (unsigned long long)st[cls].idle);
+    }
+    fflush(stdout);
+}
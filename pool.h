@@ -0,0 +1,39 @@
+#ifndef _MBUS_POOL__H
+#define _MBUS_POOL__H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Size-classed object pools for queries, answers and RTU buffers.
+ * Every thread keeps its own free lists, batches of objects move
+ * through the shared per-class lists, so objects freed by other
+ * thread return to the producer. Objects larger than the biggest
+ * class fall back to malloc().
+ */
+#define POOL_MIN_SHIFT  6       /* 64 bytes including the header */
+#define POOL_CLASSES    5       /* 64, 128, 256, 512, 1024 */
+#ifdef _NUTTX_BUILD
+#define POOL_BATCH      4       /* objects moved at once between the lists */
+#define POOL_SLAB       2048
+#else
+#define POOL_BATCH      32
+#define POOL_SLAB       65536
+#endif
+
+/* Counters of the class, the last entry is for malloc() fallbacks */
+struct pool_stat {
+    size_t size;            /* object size, 0 for fallbacks */
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t slabs;         /* slabs carved for the class */
+    uint64_t idle;          /* objects kept in the shared list */
+};
+
+extern void *pool_alloc(size_t size);
+extern void *pool_zalloc(size_t size);
+extern void pool_free(void *ptr);
+extern void pool_stats(struct pool_stat *st);
+extern void pool_dump(void);
+
+#endif /* _MBUS_POOL__H */
@@ -0,0 +1,74 @@
+#include <stdlib.h>
+
+#include "ring.h"
+
+/* Size is rounded up to power of 2 */
+int ring_init(struct ring *r, uint32_t size)
+{
+    uint32_t n = 2;
+    uint32_t i;
+
+    while (n < size)
+        n <<= 1;
+
+    r->cells = malloc(n * sizeof(struct ring_cell));
+    if (!r->cells)
+        return -1;
+
+    for (i = 0; i < n; ++i) {
+        r->cells[i].seq = i;
+        r->cells[i].data = NULL;
+    }
+    r->mask = n - 1;
+    r->head = 0;
+    r->tail = 0;
+
+    return 0;
+}
+
+/* Returns -1 if the ring is full */
+int ring_push(struct ring *r, void *data)
+{
+    struct ring_cell *cell;
+    uint32_t pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+
+    for (;;) {
+        int32_t dif;
+
+        cell = &r->cells[pos & r->mask];
+        dif = (int32_t)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+        if (dif == 0) {
+            /* Cell is free, claim the position */
+            if (__atomic_compare_exchange_n(&r->head, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (dif < 0) {
+            /* Consumer is a lap behind */
+            return -1;
+        } else {
+            pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    cell->data = data;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/* Returns NULL if the ring is empty, single consumer only */
+void *ring_pop(struct ring *r)
+{
+    struct ring_cell *cell = &r->cells[r->tail & r->mask];
+    void *data;
+
+    if ((int32_t)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (r->tail + 1)) < 0)
+        return NULL;
+
+    data = cell->data;
+    /* Free the cell for the producer of the next lap */
+    __atomic_store_n(&cell->seq, r->tail + r->mask + 1, __ATOMIC_RELEASE);
+    r->tail++;
+
+    return data;
+}
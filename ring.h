@@ -0,0 +1,29 @@
+#ifndef _MBUS_RING__H
+#define _MBUS_RING__H 1
+
+#include <stdint.h>
+
+#define RING_CACHELINE  64
+
+/*
+ * Bounded lock-free queue of pointers for many producers and a single
+ * consumer. Every cell carries a sequence number telling whether it is
+ * free for the producer of the lap or filled for the consumer.
+ */
+struct ring_cell {
+    uint32_t seq;
+    void *data;
+};
+
+struct ring {
+    struct ring_cell *cells;
+    uint32_t mask;          /* number of cells - 1 */
+    uint32_t head __attribute__((aligned(RING_CACHELINE)));  /* next push position */
+    uint32_t tail __attribute__((aligned(RING_CACHELINE)));  /* next pop position, consumer only */
+};
+
+extern int ring_init(struct ring *r, uint32_t size);
+extern int ring_push(struct ring *r, void *data);
+extern void *ring_pop(struct ring *r);
+
+#endif /* _MBUS_RING__H */
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <string.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <termios.h>
@@ -39,12 +40,124 @@ int setnonblocking(int sockfd)
     return 0;
 }
 
+/*
+ * Length of the answer frame from its first `len' bytes: 0 while the
+ * header is not complete, -1 if the function code is unknown and the
+ * frame ends on the line silence.
+ */
+int rtu_frame_len(const uint8_t *buf, int len)
+{
+    if (len < 2)
+        return 0;
+
+    if (buf[1] & 0x80)
+        return 5;
+
+    switch (buf[1]) {
+    case 1: case 2: case 3: case 4:
+    case 12: case 17: case 20: case 21: case 23:
+        /* byte count */
+        return len < 3 ? 0 : buf[2] + 5;
+    case 24:
+        /* 2-bytes byte count */
+        return len < 4 ? 0 : ((buf[2] << 8) | buf[3]) + 6;
+    case 7:
+        return 5;
+    case 5: case 6: case 8: case 11: case 15: case 16:
+        return 8;
+    case 22:
+        return 10;
+    }
+
+    return -1;
+}
+
+/* Complete frame has the expected length and valid CRC */
+int rtu_frame_check(const uint8_t *buf, int len)
+{
+    int flen = rtu_frame_len(buf, len);
+    uint16_t crc;
+
+    if (len < RTU_FRAME_MIN || (flen >= 0 && flen != len))
+        return 0;
+
+    memcpy(&crc, buf + len - 2, 2);
+    return crc == crc16(buf, len - 2);
+}
+
+/* Bit rate of the line, -1 if the speed is unknown */
+static int rtu_baud(const struct termios *t)
+{
+    static const struct {
+        speed_t spd;
+        int baud;
+    } rates[] = {
+        { B1200, 1200 }, { B2400, 2400 }, { B4800, 4800 }, { B9600, 9600 },
+        { B19200, 19200 }, { B38400, 38400 }, { B57600, 57600 }, { B115200, 115200 },
+    };
+    speed_t spd = cfgetospeed(t);
+    int i;
+
+    for (i = 0; i < sizeof(rates) / sizeof(rates[0]); ++i) {
+        if (rates[i].spd == spd)
+            return rates[i].baud;
+    }
+
+    return -1;
+}
+
+/*
+ * Frame timing of the serial line from its baud, data bits, parity
+ * and stop bits. Above 19200 baud t1.5 and t3.5 are fixed to 750 and
+ * 1750 usec (Modbus over serial line, 2.5.1.1). The answer is read in
+ * bursts of the UART FIFO, so a partial frame is broken only after
+ * t1.5 plus the FIFO time. Values from the config are kept.
+ * Returns -1 if the baud rate is not supported.
+ */
+static int rtu_timing(struct rtu_desc *rtu)
+{
+    const struct termios *t = &rtu->cfg.serial.t;
+    int baud = rtu_baud(t);
+    int bits;
+    uint32_t t15;
+
+    if (baud < 0)
+        return -1;
+
+    switch (t->c_cflag & CSIZE) {
+    case CS5: bits = 5; break;
+    case CS6: bits = 6; break;
+    case CS7: bits = 7; break;
+    default:  bits = 8; break;
+    }
+    /* start bit, parity, stop bits */
+    bits += 1 + ((t->c_cflag & PARENB) ? 1 : 0) + ((t->c_cflag & CSTOPB) ? 2 : 1);
+
+    rtu->char_usec = (bits * 1000000 + baud - 1) / baud;
+    t15 = baud > 19200 ? 750 : (rtu->char_usec * 3 + 1) / 2;
+    if (!rtu->frame_gap)
+        rtu->frame_gap = baud > 19200 ? 1750 : (rtu->char_usec * 7 + 1) / 2;
+    if (!rtu->char_timeout)
+        rtu->char_timeout = t15 + RTU_RX_FIFO * rtu->char_usec + RTU_RX_LATENCY;
+    DEBUGF("timing(%s): %d baud, %d bits, t3.5=%u char_timeout=%u usec\n",
+           rtu->cfg.serial.devname, baud, bits, rtu->frame_gap, rtu->char_timeout);
+
+    return 0;
+}
+
 int rtu_open_serial(struct rtu_desc *rtu)
 {
     int v = -1;
     struct termios options;
 
-    /* TODO: setup baud rate, bits and parity */
+    if (rtu->cfg.serial.t.c_cflag == 0)
+        rtu->cfg.serial.t.c_cflag = rtu->conf->baud;
+    if (rtu_timing(rtu) < 0) {
+        printf("Unsupported baud rate of (%s)\n", rtu->cfg.serial.devname);
+        rtu->fd = -1;
+        return -1;
+    }
+
     printf("Opening (%s)\n", rtu->cfg.serial.devname);
     rtu->fd = open(rtu->cfg.serial.devname, O_RDWR | O_NONBLOCK);
     if (rtu->fd != -1) {
@@ -56,9 +169,6 @@ int rtu_open_serial(struct rtu_desc *rtu)
                                   | XCASE
 #endif
                             );
-        options.c_cflag &= ~(CSIZE | PARENB);
-        if (rtu->cfg.serial.t.c_cflag == 0)
-            rtu->cfg.serial.t.c_cflag = CS8 | rtu->conf->baud;
         options.c_cflag = rtu->cfg.serial.t.c_cflag;
         options.c_cc[VMIN] = 1;
         options.c_cc[VTIME] = 0;
@@ -207,6 +317,11 @@ int rtu_open(struct rtu_desc *rtu, int ep)
         return -1;
     }
 
+    rtu->chan[CHAN_DATA].rtu = rtu;
+    rtu->chan[CHAN_DATA].type = CHAN_DATA;
+    rtu->chan[CHAN_CMD].rtu = rtu;
+    rtu->chan[CHAN_CMD].type = CHAN_CMD;
+
     switch (rtu->type) {
     case NONE:
         break;
@@ -249,10 +364,10 @@ int rtu_open(struct rtu_desc *rtu, int ep)
             break;
         }
 
-        ev.data.fd = rtu->cfg.realcom.cmdfd;
+        ev.data.ptr = &rtu->chan[CHAN_CMD];
         ev.events = EPOLLIN | EPOLLERR | EPOLLHUP;
 
-        if (epoll_ctl(ep, EPOLL_CTL_ADD, ev.data.fd, &ev) == -1) {
+        if (epoll_ctl(ep, EPOLL_CTL_ADD, rtu->cfg.realcom.cmdfd, &ev) == -1) {
             perror("epoll_ctl(realcom) failed");
             close(rc);
             rtu->cfg.realcom.cmdfd = -1;
@@ -263,10 +378,10 @@ int rtu_open(struct rtu_desc *rtu, int ep)
     }
 
     if (rc != -1) {
-        ev.data.fd = rc;
+        ev.data.ptr = &rtu->chan[CHAN_DATA];
         ev.events = EPOLLIN | EPOLLERR | EPOLLHUP;
 
-        if (epoll_ctl(ep, EPOLL_CTL_ADD, ev.data.fd, &ev) == -1) {
+        if (epoll_ctl(ep, EPOLL_CTL_ADD, rc, &ev) == -1) {
             perror("epoll_ctl(rtu) failed");
             close(rc);
 #ifndef _NUTTX_BUILD
@@ -9,7 +9,13 @@
 #define RS485_2WIRE_MODE	1
 #define RS485_4WIRE_MODE	3
 
+/* Serial line ADU: slave id, PDU, CRC */
+#define RTU_FRAME_MIN		5
+#define RTU_FRAME_MAX		256
+
 extern int setnonblocking(int sockfd);
+extern int rtu_frame_len(const uint8_t *buf, int len);
+extern int rtu_frame_check(const uint8_t *buf, int len);
 
 extern int rtu_open(struct rtu_desc *rtu, int ep);
 extern void rtu_close(struct rtu_desc *rtu, int ep);
@@ -0,0 +1,266 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "cfg.h"
+#include "stats.h"
+
+static uint64_t stats_start;
+
+/* Slots of the tcp_threads and the RTUs, called before the threads are started */
+int stats_init(struct cfg *cfg)
+{
+    struct rtu_desc *ri;
+    void *p;
+    int n;
+
+    stats_start = clock_usec();
+
+    for (n = 0; n < cfg->workers; ++n) {
+        if (posix_memalign(&p, STAT_ALIGN, sizeof(struct stat_worker)) != 0)
+            return -1;
+        memset(p, 0, sizeof(struct stat_worker));
+        cfg->wk[n].stat = p;
+    }
+
+    VFOREACH(cfg->rtu_list, ri) {
+        struct stat_rtu *st;
+        int slaves = 1;
+        size_t size;
+
+        for (n = 0; n < STAT_SLAVES; ++n) {
+            struct route *rt = cfg_route(cfg, n);
+
+            if (rt && rt->rtu == ri)
+                slaves++;
+        }
+
+        size = sizeof(struct stat_rtu) + slaves * sizeof(struct stat_slave);
+        if (posix_memalign(&p, STAT_ALIGN, size) != 0)
+            return -1;
+        memset(p, 0, size);
+        st = p;
+
+        slaves = 1;
+        for (n = 0; n < STAT_SLAVES; ++n) {
+            struct route *rt = cfg_route(cfg, n);
+
+            if (rt && rt->rtu == ri)
+                st->slot[n] = slaves++;
+        }
+        ri->stat = st;
+    }
+
+    return 0;
+}
+
+/* Completed transaction of the slave `src', called by the rtu_thread */
+void stat_answer(struct stat_rtu *st, int src, uint64_t rtt, int exception)
+{
+    struct stat_slave *ss = stat_slave(st, src);
+    int b = rtt ? 64 - __builtin_clzll(rtt) : 0;
+
+    if (b >= STAT_HIST)
+        b = STAT_HIST - 1;
+
+    stat_add(&st->requests, 1);
+    stat_add(&st->rtt[b], 1);
+    stat_add(&ss->requests, 1);
+    stat_add(&ss->rtt[b], 1);
+    if (exception) {
+        stat_add(&st->exceptions, 1);
+        stat_add(&ss->exceptions, 1);
+    }
+}
+
+#ifndef _NUTTX_BUILD
+/*
+ * Rates are taken over the interval since the previous report,
+ * counters of the report are kept in the order they are printed.
+ */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t stats_time;
+static uint64_t *stats_prev;
+static int stats_nprev;
+
+static double stat_delta(int *idx, uint64_t cur)
+{
+    uint64_t d = cur;
+
+    if (*idx < stats_nprev) {
+        d = cur - stats_prev[*idx];
+        stats_prev[*idx] = cur;
+    }
+    (*idx)++;
+
+    return (double)d;
+}
+
+/* Upper bound of the bucket holding the p-th percentile */
+static uint64_t stat_percentile(const uint64_t *hist, uint64_t total, double p)
+{
+    uint64_t want = total * p / 100.0 + 0.5;
+    uint64_t seen = 0;
+    int b;
+
+    for (b = 0; b < STAT_HIST; ++b) {
+        seen += hist[b];
+        if (seen >= want && seen)
+            return 1ULL << b;
+    }
+
+    return 0;
+}
+
+/* Percentiles and the non-empty buckets of the round trip histogram */
+static void stats_hist(FILE *f, const char *indent, const uint64_t *rtt)
+{
+    uint64_t hist[STAT_HIST];
+    uint64_t total = 0;
+    int b;
+
+    for (b = 0; b < STAT_HIST; ++b) {
+        hist[b] = stat_get(&rtt[b]);
+        total += hist[b];
+    }
+    if (!total)
+        return;
+
+    fprintf(f, "%srtt usec: p50 <%llu p90 <%llu p99 <%llu |", indent,
+            (unsigned long long)stat_percentile(hist, total, 50),
+            (unsigned long long)stat_percentile(hist, total, 90),
+            (unsigned long long)stat_percentile(hist, total, 99));
+    for (b = 0; b < STAT_HIST; ++b) {
+        if (hist[b])
+            fprintf(f, " <%llu:%llu", 1ULL << b, (unsigned long long)hist[b]);
+    }
+    fprintf(f, "\n");
+}
+
+static void stats_rtu(struct cfg *cfg, FILE *f, struct rtu_desc *ri, double sec, int *idx)
+{
+    struct stat_rtu *st = ri->stat;
+    uint64_t since = stat_get(&st->busy_since);
+    uint64_t busy = stat_get(&st->busy_usec);
+    double bus;
+    int s, w;
+
+    /* Period still open is counted till now, the fields may be read apart */
+    if (since)
+        busy += clock_usec() - since;
+    bus = stat_delta(idx, busy) / (sec * 1e4);
+    if (bus > 100.0)
+        bus = 100.0;
+
+    fprintf(f, "rtu %s thread %d: requests %llu (%.1f/s) queue %llu timeouts %llu "
+            "exceptions %llu errors %llu bus %.1f%%\n",
+            ri->type == TCP ? ri->cfg.tcp.hostname :
+            ri->type == RTU ? ri->cfg.serial.devname :
+            ri->type == REALCOM ? ri->cfg.realcom.hostname : "-",
+            ri->sched ? ri->sched->n : -1,
+            (unsigned long long)stat_get(&st->requests),
+            stat_delta(idx, stat_get(&st->requests)) / sec,
+            (unsigned long long)stat_get(&st->queue),
+            (unsigned long long)stat_get(&st->timeouts),
+            (unsigned long long)stat_get(&st->exceptions),
+            (unsigned long long)stat_get(&st->errors),
+            bus);
+
+    stats_hist(f, "  ", st->rtt);
+
+    for (s = 0; s < STAT_SLAVES; ++s) {
+        struct route *rt = cfg_route(cfg, s);
+        struct stat_slave *ss = stat_slave(st, s);
+        uint64_t requests = 0;
+        uint64_t hits;
+
+        if (!rt || rt->rtu != ri)
+            continue;
+
+        /* Hits of the tcp_threads and of the queued queries */
+        hits = stat_get(&ss->hits);
+        for (w = 0; w < cfg->workers; ++w) {
+            requests += stat_get(&cfg->wk[w].stat->requests[s]);
+            hits += stat_get(&cfg->wk[w].stat->hits[s]);
+        }
+        fprintf(f, "  slave %d->%d: requests %llu (%.1f/s) hits %.1f%% "
+                "rtu requests %llu timeouts %llu exceptions %llu errors %llu\n",
+                s, rt->dst, (unsigned long long)requests,
+                stat_delta(idx, requests) / sec,
+                requests ? hits * 100.0 / requests : 0.0,
+                (unsigned long long)stat_get(&ss->requests),
+                (unsigned long long)stat_get(&ss->timeouts),
+                (unsigned long long)stat_get(&ss->exceptions),
+                (unsigned long long)stat_get(&ss->errors));
+        stats_hist(f, "    ", ss->rtt);
+    }
+}
+
+/* Text report of the counters, the buffer is freed by the caller */
+char *stats_report(struct cfg *cfg, size_t *len)
+{
+    struct rtu_desc *ri;
+    char *buf = NULL;
+    uint64_t now = clock_usec();
+    double sec;
+    int active = 0;
+    int idx = 0;
+    FILE *f;
+    int n;
+
+    if (!(f = open_memstream(&buf, len)))
+        return NULL;
+
+    pthread_mutex_lock(&stats_lock);
+    if (!stats_prev) {
+        /* worker loop time, RTU requests and bus time, slave requests */
+        stats_nprev = cfg->workers + VLEN(cfg->rtu_list) * 2 + STAT_SLAVES;
+        stats_prev = calloc(stats_nprev, sizeof(uint64_t));
+        if (!stats_prev)
+            stats_nprev = 0;
+        stats_time = stats_start;
+    }
+    sec = (now - stats_time) / 1e6;
+    if (sec <= 0)
+        sec = 1e-6;
+    stats_time = now;
+
+    fprintf(f, "uptime %.1f s, interval %.1f s\n", (now - stats_start) / 1e6, sec);
+
+    for (n = 0; n < cfg->workers; ++n) {
+        struct stat_worker *st = cfg->wk[n].stat;
+        uint64_t loops = stat_get(&st->loops);
+
+        fprintf(f, "worker %d: loops %llu busy %.1f%% avg %llu usec max %llu usec rejected %llu\n",
+                n, (unsigned long long)loops,
+                stat_delta(&idx, stat_get(&st->loop_usec)) / (sec * 1e4),
+                (unsigned long long)(loops ? stat_get(&st->loop_usec) / loops : 0),
+                (unsigned long long)stat_get(&st->loop_max),
+                (unsigned long long)stat_get(&st->busy));
+    }
+
+    VFOREACH(cfg->rtu_list, ri)
+        stats_rtu(cfg, f, ri, sec, &idx);
+    pthread_mutex_unlock(&stats_lock);
+
+    /* Connections with answers not sent yet, read on the fly without their locks */
+    for (n = 0; n < cfg->maxconns; ++n) {
+        struct conn *c = &cfg->conns[n];
+        uint32_t olen;
+
+        if (__atomic_load_n(&c->ep, __ATOMIC_RELAXED) < 0)
+            continue;
+        active++;
+        olen = __atomic_load_n(&c->olen, __ATOMIC_RELAXED);
+        if (olen)
+            fprintf(f, "conn #%d worker %d: pending %u bytes\n", n,
+                    __atomic_load_n(&c->worker, __ATOMIC_RELAXED), olen);
+    }
+    fprintf(f, "connections %d\n", active);
+
+    fclose(f);
+
+    return buf;
+}
+#endif
@@ -0,0 +1,90 @@
+#ifndef _MBUS_STATS__H
+#define _MBUS_STATS__H 1
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Live counters of the gateway. Every slot has a single writer,
+ * the thread owning it, and is aligned to its own cache lines;
+ * the stats command reads them on the fly.
+ */
+#define STAT_SLAVES     256     /* slave ids */
+#define STAT_HIST       24      /* log2 usec buckets of the round trip, up to ~16 sec */
+#define STAT_ALIGN      64
+
+/* Counters of a tcp_thread */
+struct stat_worker {
+    uint64_t loops;         /* epoll_wait() wakeups */
+    uint64_t loop_usec;     /* time spent on the events */
+    uint64_t loop_max;
+    uint64_t busy;          /* requests rejected, submit ring is full */
+    uint64_t requests[STAT_SLAVES]; /* by the slave id of the client */
+    uint64_t hits[STAT_SLAVES];     /* answered from the cache */
+} __attribute__((aligned(STAT_ALIGN)));
+
+struct stat_slave {
+    uint64_t requests;      /* transactions on the RTU */
+    uint64_t timeouts;
+    uint64_t exceptions;
+    uint64_t errors;        /* corrupt answers */
+    uint64_t hits;          /* queued queries answered from the cache */
+    uint64_t rtt[STAT_HIST];
+};
+
+/*
+ * Counters of an RTU, written by its rtu_thread. Only the slaves mapped
+ * to the RTU have their own slot, slot 0 is shared by the rest.
+ */
+struct stat_rtu {
+    uint64_t requests;
+    uint64_t timeouts;
+    uint64_t exceptions;
+    uint64_t errors;
+    uint64_t busy_usec;     /* time with a transaction in flight, closed periods */
+    uint64_t busy_since;    /* start of the open period, 0 if idle */
+    uint64_t queue;         /* queries queued after the last pass */
+    uint64_t rtt[STAT_HIST];
+    uint16_t slot[STAT_SLAVES]; /* by the slave id of the client */
+    struct stat_slave slave[];
+} __attribute__((aligned(STAT_ALIGN)));
+
+struct cfg;
+
+/* Owner updates the counter, readers never see it torn */
+static inline void stat_add(uint64_t *c, uint64_t v)
+{
+    __atomic_store_n(c, *c + v, __ATOMIC_RELAXED);
+}
+
+static inline void stat_set(uint64_t *c, uint64_t v)
+{
+    __atomic_store_n(c, v, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t stat_get(const uint64_t *c)
+{
+    return __atomic_load_n(c, __ATOMIC_RELAXED);
+}
+
+static inline struct stat_slave *stat_slave(struct stat_rtu *st, int src)
+{
+    return &st->slave[st->slot[src & (STAT_SLAVES - 1)]];
+}
+
+/* Transactions in flight on the RTU or not, overlapping ones count once */
+static inline void stat_busy(struct stat_rtu *st, int busy, uint64_t now)
+{
+    if (busy && !st->busy_since) {
+        stat_set(&st->busy_since, now);
+    } else if (!busy && st->busy_since) {
+        stat_add(&st->busy_usec, now - st->busy_since);
+        stat_set(&st->busy_since, 0);
+    }
+}
+
+extern int stats_init(struct cfg *cfg);
+extern void stat_answer(struct stat_rtu *st, int src, uint64_t rtt, int exception);
+extern char *stats_report(struct cfg *cfg, size_t *len);
+
+#endif /* _MBUS_STATS__H */
@@ -0,0 +1,182 @@
+#include <string.h>
+
+#include "timer.h"
+
+static inline void tw_link(struct timer *head, struct timer *t)
+{
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static inline void tw_unlink(struct timer *t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
+
+/* Move all timers of the slot to the empty list */
+static inline void tw_splice(struct timer *head, struct timer *list)
+{
+    if (head->next == head) {
+        list->next = list->prev = list;
+        return;
+    }
+    list->next = head->next;
+    list->prev = head->prev;
+    list->next->prev = list;
+    list->prev->next = list;
+    head->next = head->prev = head;
+}
+
+static void tw_insert(struct timer_wheel *tw, struct timer *t)
+{
+    uint64_t expires = t->expires;
+    uint64_t idx;
+    int lvl;
+
+    if ((int64_t)(expires - tw->now) < 0) {
+        /* Already expired, fire on the next tick */
+        tw_link(&tw->slots[0][tw->now & TW_MASK], t);
+        return;
+    }
+
+    idx = expires - tw->now;
+    if (idx >= TW_RANGE) {
+        expires = tw->now + TW_RANGE - 1;
+        idx = TW_RANGE - 1;
+    }
+
+    for (lvl = 0; lvl < TW_LEVELS - 1; ++lvl) {
+        if (idx < (1ULL << (TW_BITS * (lvl + 1))))
+            break;
+    }
+
+    tw_link(&tw->slots[lvl][(expires >> (TW_BITS * lvl)) & TW_MASK], t);
+}
+
+/* Redistribute timers of the upper level slot to the lower levels */
+static int tw_cascade(struct timer_wheel *tw, int lvl, int index)
+{
+    struct timer list;
+    struct timer *t;
+
+    tw_splice(&tw->slots[lvl][index], &list);
+    while ((t = list.next) != &list) {
+        tw_unlink(t);
+        tw_insert(tw, t);
+    }
+
+    return index;
+}
+
+void timer_wheel_init(struct timer_wheel *tw, uint64_t now)
+{
+    int lvl;
+    int i;
+
+    memset(tw, 0, sizeof(*tw));
+    tw->now = now;
+    for (lvl = 0; lvl < TW_LEVELS; ++lvl) {
+        for (i = 0; i < TW_SIZE; ++i) {
+            tw->slots[lvl][i].next = &tw->slots[lvl][i];
+            tw->slots[lvl][i].prev = &tw->slots[lvl][i];
+        }
+    }
+}
+
+void timer_add(struct timer_wheel *tw, struct timer *t, uint64_t expires)
+{
+    if (timer_pending(t))
+        timer_del(tw, t);
+
+    t->expires = expires;
+    tw_insert(tw, t);
+    tw->count++;
+}
+
+void timer_del(struct timer_wheel *tw, struct timer *t)
+{
+    if (!timer_pending(t))
+        return;
+
+    tw_unlink(t);
+    tw->count--;
+}
+
+/*
+ * Run callbacks of all timers expired by `now'.
+ * Callback is allowed to add and delete any timers.
+ * Returns number of expired timers.
+ */
+int timer_expire(struct timer_wheel *tw, uint64_t now, timer_fn fn, void *arg)
+{
+    struct timer list;
+    struct timer *t;
+    int expired = 0;
+
+    while ((int64_t)(now - tw->now) >= 0) {
+        int index = tw->now & TW_MASK;
+        int lvl;
+
+        if (!tw->count) {
+            /* Nothing to wait for, skip idle ticks at once */
+            tw->now = now + 1;
+            break;
+        }
+
+        if (!index) {
+            for (lvl = 1; lvl < TW_LEVELS; ++lvl) {
+                if (tw_cascade(tw, lvl, (tw->now >> (TW_BITS * lvl)) & TW_MASK))
+                    break;
+            }
+        }
+
+        tw->now++;
+
+        tw_splice(&tw->slots[0][index], &list);
+        while ((t = list.next) != &list) {
+            tw_unlink(t);
+            tw->count--;
+            expired++;
+            fn(t, arg);
+        }
+    }
+
+    return expired;
+}
+
+/* Returns the earliest expiration time, zero if no timers are pending */
+uint64_t timer_next(struct timer_wheel *tw)
+{
+    uint64_t next = 0;
+    int lvl;
+    int i;
+
+    if (!tw->count)
+        return 0;
+
+    for (lvl = 0; lvl < TW_LEVELS; ++lvl) {
+        int cur = (tw->now >> (TW_BITS * lvl)) & TW_MASK;
+        /* Current slot is not cascaded yet at the start of its period */
+        int first = (tw->now & ((1ULL << (TW_BITS * lvl)) - 1)) ? 1 : 0;
+
+        for (i = first; i < TW_SIZE + first; ++i) {
+            struct timer *head = &tw->slots[lvl][(cur + i) & TW_MASK];
+            struct timer *t;
+
+            if (head->next == head)
+                continue;
+
+            for (t = head->next; t != head; t = t->next) {
+                if (!next || t->expires < next)
+                    next = t->expires;
+            }
+            break;
+        }
+    }
+
+    return next;
+}
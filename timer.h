@@ -0,0 +1,64 @@
+#ifndef _MBUS_TIMER__H
+#define _MBUS_TIMER__H 1
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+/*
+ * Hierarchical timer wheel with 1 msec tick:
+ * 4 levels of 64 slots cover 2^24 msec (~4.6 hours),
+ * farther timers are parked at the last level and cascaded again.
+ */
+#define TW_BITS     6
+#define TW_SIZE     (1 << TW_BITS)
+#define TW_MASK     (TW_SIZE - 1)
+#define TW_LEVELS   4
+#define TW_RANGE    (1ULL << (TW_BITS * TW_LEVELS))
+
+#ifndef container_of
+#define container_of(ptr, type, member) \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
+#endif
+
+struct timer {
+    struct timer *next;
+    struct timer *prev;
+    uint64_t expires;       /* msec, monotonic */
+    int type;               /* kind of the owner */
+    void *data;             /* owner context */
+};
+
+struct timer_wheel {
+    uint64_t now;           /* next tick to process, msec */
+    int count;              /* number of pending timers */
+    struct timer slots[TW_LEVELS][TW_SIZE];
+};
+
+typedef void (*timer_fn)(struct timer *t, void *arg);
+
+static inline uint64_t clock_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline uint64_t clock_msec(void)
+{
+    return clock_usec() / 1000;
+}
+
+static inline int timer_pending(const struct timer *t)
+{
+    return t->next != NULL;
+}
+
+extern void timer_wheel_init(struct timer_wheel *tw, uint64_t now);
+extern void timer_add(struct timer_wheel *tw, struct timer *t, uint64_t expires);
+extern void timer_del(struct timer_wheel *tw, struct timer *t);
+extern int timer_expire(struct timer_wheel *tw, uint64_t now, timer_fn fn, void *arg);
+extern uint64_t timer_next(struct timer_wheel *tw);
+
+#endif /* _MBUS_TIMER__H */